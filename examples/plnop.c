@@ -0,0 +1,136 @@
+#include "pl2b.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* A language of commands doing nothing, reporting per-command dispatch
+   cost of pl2b_run at exit. Timing starts from the first command, so
+   that loading and linking are not counted. `nop` goes through one stub
+   call per command, while `bnop` gets batched for consecutive runs.
+   `sleep <ms>` waits, suspending the run if it is on a scheduler, and
+   is thread-safe so that `?parallel` blocks of it sleep concurrently. */
+
+extern pl2b_Language*
+pl2ext_loadLanguage(pl2b_SemVer version, pl2b_Error *error);
+
+typedef struct st_plnop_context {
+  struct timespec start;
+  size_t cmdCount;
+} plnop_Context;
+
+static void *plnop_init(pl2b_Error *error);
+static void plnop_atExit(void *context);
+static pl2b_Cmd *plnop_nop(pl2b_Program *program,
+                           void *context,
+                           pl2b_Cmd *cmd,
+                           pl2b_Error *error);
+static pl2b_Cmd *plnop_batch(pl2b_Program *program,
+                             void *context,
+                             pl2b_Cmd *first,
+                             uint32_t count,
+                             pl2b_Error *error);
+static pl2b_Cmd *plnop_sleep(pl2b_Program *program,
+                             void *context,
+                             pl2b_Cmd *cmd,
+                             pl2b_Error *error);
+static void plnop_count(plnop_Context *ctx, uint32_t count);
+
+pl2b_Language *pl2ext_loadLanguage(pl2b_SemVer version,
+                                   pl2b_Error *error) {
+  (void)version;
+  (void)error;
+
+  static pl2b_PCallCmd cmds[] = {
+    { "nop", NULL, plnop_nop, 0, 0, NULL, 0 },
+    { "bnop", NULL, plnop_nop, 0, 0, plnop_batch, 0 },
+    { "sleep", NULL, plnop_sleep, 0, 0, NULL, 1 },
+    { NULL, NULL, NULL, 0, 0, NULL, 0 }
+  };
+
+  static pl2b_Language ret = {
+    /*langName    = */ "PL2 no-op benchmark",
+    /*langInfo    = */ "this language measures command dispatch cost",
+
+    /*init        = */ plnop_init,
+    /*atExit      = */ plnop_atExit,
+    /*cmdCleanup  = */ NULL,
+    /*pCallCmds   = */ cmds,
+    /*fallback    = */ plnop_nop
+  };
+
+  return &ret;
+}
+
+static void *plnop_init(pl2b_Error *error) {
+  plnop_Context *ret = (plnop_Context*)malloc(sizeof(plnop_Context));
+  if (ret == NULL) {
+    pl2b_errPrintf(error, PL2B_ERR_MALLOC, pl2b_sourceInfo(NULL, 0),
+                   NULL, "plnop: cannot allocate memory for context");
+    return NULL;
+  }
+  ret->cmdCount = 0;
+  return ret;
+}
+
+static void plnop_atExit(void *context) {
+  plnop_Context *ctx = (plnop_Context*)context;
+  if (ctx->cmdCount != 0) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double nanos = (double)(end.tv_sec - ctx->start.tv_sec) * 1e9
+                   + (double)(end.tv_nsec - ctx->start.tv_nsec);
+    fprintf(stderr, "plnop: %zu commands, %.1f ns/command\n",
+            ctx->cmdCount, nanos / (double)ctx->cmdCount);
+  }
+  free(ctx);
+}
+
+static pl2b_Cmd *plnop_nop(pl2b_Program *program,
+                           void *context,
+                           pl2b_Cmd *cmd,
+                           pl2b_Error *error) {
+  (void)program;
+  (void)error;
+
+  plnop_count((plnop_Context*)context, 1);
+  return cmd->next;
+}
+
+static pl2b_Cmd *plnop_batch(pl2b_Program *program,
+                             void *context,
+                             pl2b_Cmd *first,
+                             uint32_t count,
+                             pl2b_Error *error) {
+  (void)program;
+  (void)error;
+
+  plnop_count((plnop_Context*)context, count);
+  pl2b_Cmd *last = first;
+  for (uint32_t i = 1; i < count; i++) {
+    last = last->next;
+  }
+  return last->next;
+}
+
+static pl2b_Cmd *plnop_sleep(pl2b_Program *program,
+                             void *context,
+                             pl2b_Cmd *cmd,
+                             pl2b_Error *error) {
+  (void)context;
+
+  if (pl2b_argsLen(cmd) != 1) {
+    pl2b_errPrintf(error, PL2B_ERR_USER, cmd->sourceInfo, NULL,
+                   "sleep: expected 1 argument, got %u",
+                   pl2b_argsLen(cmd));
+    return NULL;
+  }
+  uint64_t millis = strtoull(cmd->args[0].str, NULL, 10);
+  return pl2b_waitTimer(program, millis * 1000000, cmd->next);
+}
+
+static void plnop_count(plnop_Context *ctx, uint32_t count) {
+  if (ctx->cmdCount == 0) {
+    clock_gettime(CLOCK_MONOTONIC, &ctx->start);
+  }
+  ctx->cmdCount += count;
+}
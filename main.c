@@ -1,7 +1,108 @@
+#define _GNU_SOURCE
+
 #include "pl2b.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+typedef struct st_script {
+  char *buffer;
+  size_t size;
+  size_t mapSize;
+} Script;
+
+/* A batch run has `jobs` runner threads claiming scripts in order. A
+   runner parses the script it claims, and before running one also
+   parses the next script ahead into a bounded queue, for whichever
+   runner gets free first. */
+typedef struct st_batch_item {
+  const char *path;
+  pl2b_Program program;
+  pl2b_Error *error;
+  Script script;      /* source parts point into, if `keepsSource` */
+  _Bool keepsSource;
+  _Bool parsed;
+  uint64_t parseNanos;
+  uint64_t runNanos;
+} BatchItem;
+
+typedef struct st_batch {
+  BatchItem *items;
+  size_t itemCount;
+  _Bool useCache;
+  uint16_t flags;     /* pl2b_parse4 flags */
+
+  pthread_mutex_t lock;
+  size_t nextItem;    /* first item not claimed yet */
+  size_t parsing;     /* items being parsed ahead */
+  size_t *queue;      /* ring of item indices parsed ahead */
+  size_t queueCap;    /* bounds items parsed ahead, `parsing` included */
+  size_t queueHead;
+  size_t queueSize;
+} Batch;
+
+typedef struct st_batch_runner {
+  Batch *batch;
+  long cpu;           /* CPU to pin to, or -1 */
+} BatchRunner;
+
+static int runScript(const char *path,
+                     _Bool useCache,
+                     uint16_t flags,
+                     const char *profilePrefix);
+static void writeProfile(pl2b_Profile *profile, const char *prefix);
+static int runBatch(const char *paths[],
+                    size_t pathCount,
+                    long jobs,
+                    _Bool pin,
+                    _Bool useCache,
+                    uint16_t flags,
+                    FILE *summary);
+static int runEvents(const char *paths[],
+                     size_t pathCount,
+                     _Bool useCache,
+                     uint16_t flags,
+                     FILE *summary);
+static void eventDone(pl2b_Program *program,
+                      pl2b_Error *error,
+                      void *item);
+static size_t finishBatch(BatchItem *items,
+                          size_t count,
+                          const char *mode,
+                          uint64_t elapsed,
+                          FILE *summary);
+static void *batchRunner(void *runner);
+static void parseItem(Batch *b, BatchItem *item);
+static void runItem(BatchItem *item);
+static void writeSummary(FILE *fp, const BatchItem *items, size_t count);
+static void writeField(FILE *fp, const char *str);
+static const char **readPathList(FILE *fp, size_t *count);
+static uint64_t nanosNow(void);
+static pl2b_Program loadProgram(const char *path,
+                                Script *script,
+                                _Bool useCache,
+                                uint16_t flags,
+                                pl2b_Error *error);
+static int openScript(const char *path,
+                      Script *script,
+                      pl2b_Error *error);
+static int mapScript(int fd, size_t fileSize, Script *script);
+static int readScript(int fd, Script *script);
+static void closeScript(Script *script);
+static pl2b_Program loadItem(BatchItem *item,
+                             _Bool useCache,
+                             uint16_t flags);
+static void dropItem(BatchItem *item);
+static char *imagePath(const char *path);
 
 int main(int argc, const char *argv[]) {
   fprintf(stderr,
@@ -17,62 +118,744 @@ int main(int argc, const char *argv[]) {
     PL2B_VER_PATCH,
     PL2B_VER_POSTFIX);
 
-  if (argc != 2) {
-    fprintf(stderr, "expected 1 argument, got %d\n", argc - 1);
+  if (!pl2b_isCompatible(PL2B_HEADER_VERSION, pl2b_version())) {
+    pl2b_SemVer libVersion = pl2b_version();
+    fprintf(stderr,
+            "incompatible PL2B library v%u.%u.%u %.*s loaded\n",
+            libVersion.major,
+            libVersion.minor,
+            libVersion.patch,
+            PL2B_SEMVER_POSTFIX_LEN,
+            libVersion.postfix);
     return -1;
   }
 
-  FILE *fp = fopen(argv[1], "r");
-  if (fp == NULL) {
-    fprintf(stderr, "cannot open input file %s\n", argv[1]);
-    return -1;
+  _Bool useCache = 0;
+  _Bool lazy = 0;
+  _Bool intern = 0;
+  _Bool pin = 0;
+  _Bool events = 0;
+  long jobs = 0;
+  const char *summaryPath = NULL;
+  const char *profilePrefix = NULL;
+  long traceSize = 0;
+  int argIdx = 1;
+  for (; argIdx < argc; argIdx++) {
+    if (!strcmp(argv[argIdx], "--cache")) {
+      useCache = 1;
+    } else if (!strcmp(argv[argIdx], "--lazy")) {
+      lazy = 1;
+    } else if (!strcmp(argv[argIdx], "--intern")) {
+      intern = 1;
+    } else if (!strcmp(argv[argIdx], "--pin")) {
+      pin = 1;
+    } else if (!strcmp(argv[argIdx], "--events")) {
+      events = 1;
+    } else if (!strcmp(argv[argIdx], "-j") && argIdx + 1 < argc) {
+      jobs = strtol(argv[++argIdx], NULL, 10);
+      jobs = jobs > 0 ? jobs : -1;
+    } else if (!strcmp(argv[argIdx], "--summary") && argIdx + 1 < argc) {
+      summaryPath = argv[++argIdx];
+    } else if (!strcmp(argv[argIdx], "--profile") && argIdx + 1 < argc) {
+      profilePrefix = argv[++argIdx];
+    } else if (!strcmp(argv[argIdx], "--trace") && argIdx + 1 < argc) {
+      traceSize = strtol(argv[++argIdx], NULL, 10);
+      traceSize = traceSize > 0 && traceSize <= UINT32_MAX ? traceSize : -1;
+    } else {
+      break;
+    }
   }
 
-  long fileSize = 0;
-  if (fseek(fp, 0, SEEK_END) < 0) {
-    fprintf(stderr, "cannot determine file size\n");
+  _Bool batchMode = jobs != 0 || events;
+  if ((useCache && lazy)
+      || jobs < 0
+      || traceSize < 0
+      || (events && (jobs != 0 || pin))
+      || (batchMode && (lazy || profilePrefix != NULL))
+      || (!batchMode && (pin || summaryPath != NULL))
+      || (!batchMode && argIdx != argc - 1)) {
+    fprintf(stderr,
+            "usage: %s [--cache | --lazy] [--intern] [--profile <prefix>] "
+            "<script>\n"
+            "       %s -j <jobs> [--pin] [--cache] [--intern] "
+            "[--summary <file>] [<script>...]\n"
+            "       %s --events [--cache] [--intern] [--summary <file>] "
+            "[<script>...]\n"
+            "batch mode reads script paths from stdin if none given\n"
+            "--intern shares equal strings between commands, for languages "
+            "that never\n"
+            "modify arguments in place\n"
+            "profiling writes <prefix>.txt and <prefix>.folded\n"
+            "--trace <n>, allowed in any mode, keeps the last <n> "
+            "commands of each run,\n"
+            "dumped when it fails or on SIGUSR1\n",
+            argv[0], argv[0], argv[0]);
     return -1;
   }
-  fileSize = ftell(fp);
-  if (fileSize < 0) {
-    fprintf(stderr, "cannot determine file size\n");
-    return -1;
+
+  if (traceSize != 0) {
+    pl2b_setTraceSize((uint32_t)traceSize);
+    if (!pl2b_traceOnSignal(SIGUSR1)) {
+      fprintf(stderr, "cannot install trace signal handler\n");
+    }
   }
 
-  char *buffer = (char*)malloc((size_t)fileSize + 1);
-  memset(buffer, 0, (size_t)fileSize + 1);
-  rewind(fp);
-  if ((long)fread(buffer, 1, (size_t)fileSize, fp) < fileSize) {
-    fprintf(stderr, "cannot read file\n");
-    return -1;
+  /* lazy programs only report syntax errors once reaching them */
+  uint16_t flags = (lazy ? PL2B_PARSE_LAZY : PL2B_PARSE_DENSE)
+                   | (intern ? PL2B_PARSE_INTERN : 0);
+  if (!batchMode) {
+    return runScript(argv[argIdx], useCache, flags, profilePrefix);
+  }
+
+  const char **paths = argv + argIdx;
+  size_t pathCount = (size_t)(argc - argIdx);
+  const char **pathList = NULL;
+  if (pathCount == 0) {
+    pathList = readPathList(stdin, &pathCount);
+    if (pathList == NULL) {
+      fprintf(stderr, "cannot read script list from stdin\n");
+      return -1;
+    }
+    paths = pathList;
+  }
+
+  FILE *summary = stdout;
+  if (summaryPath != NULL) {
+    summary = fopen(summaryPath, "w");
+    if (summary == NULL) {
+      fprintf(stderr, "cannot open summary file %s\n", summaryPath);
+      return -1;
+    }
+  }
+
+  int ret = events
+            ? runEvents(paths, pathCount, useCache, flags, summary)
+            : runBatch(paths, pathCount, jobs, pin, useCache, flags,
+                       summary);
+  if (summary != stdout) {
+    fclose(summary);
   }
+  if (pathList != NULL) {
+    for (size_t i = 0; i < pathCount; i++) {
+      free((void*)pathList[i]);
+    }
+    free(pathList);
+  }
+  return ret;
+}
 
+static int runScript(const char *path,
+                     _Bool useCache,
+                     uint16_t flags,
+                     const char *profilePrefix) {
   pl2b_Error *error = pl2b_errorBuffer(512);
-  pl2b_Program program = pl2b_parse(buffer, 512, error);
+  pl2b_Profile *profile =
+    profilePrefix != NULL ? pl2b_createProfile() : NULL;
+  if (error == NULL || (profilePrefix != NULL && profile == NULL)) {
+    fprintf(stderr, "cannot allocate memory\n");
+    if (error != NULL) {
+      pl2b_dropError(error);
+    }
+    return -1;
+  }
+
+  /* parts point into source unless interned, lazy ones in any case */
+  _Bool keepSource = (flags & PL2B_PARSE_LAZY) != 0
+                     || (flags & PL2B_PARSE_INTERN) == 0;
+  Script script;
+  pl2b_Program program =
+    loadProgram(path, keepSource ? &script : NULL, useCache, flags, error);
   if (pl2b_isError(error)) {
-    fprintf(stderr,
-            "parsing error %d: line %d: %s\n",
-            error->errorCode,
-            error->sourceInfo.line,
-            error->reason);
+    if (error->sourceInfo.line != 0) {
+      fprintf(stderr,
+              "parsing error %d: line %u: %s\n",
+              error->errorCode,
+              error->sourceInfo.line,
+              error->reason);
+    } else {
+      fprintf(stderr, "%s\n", error->reason);
+    }
+    pl2b_dropError(error);
+    if (profile != NULL) {
+      pl2b_dropProfile(profile);
+    }
     return -1;
   }
 
   int ret = 0;
-  pl2b_run(&program, error);
+  if (profile != NULL) {
+    pl2b_runProfiled(&program, profile, error);
+  } else {
+    pl2b_run(&program, error);
+  }
   if (pl2b_isError(error)) {
     fprintf(stderr,
-            "runtime error %d: line %d: %s\n",
+            "runtime error %d: line %u: %s\n",
             error->errorCode,
             error->sourceInfo.line,
             error->reason);
     ret = -1;
   }
 
+  if (profile != NULL) {
+    writeProfile(profile, profilePrefix);
+    pl2b_dropProfile(profile);
+  }
   pl2b_dropProgram(&program);
   pl2b_dropError(error);
-  free(buffer);
-  fclose(fp);
+  if (keepSource) {
+    closeScript(&script);
+  }
+  return ret;
+}
+
+static void writeProfile(pl2b_Profile *profile, const char *prefix) {
+  size_t len = strlen(prefix);
+  char *path = (char*)malloc(len + 8);
+  pl2b_Error *error = pl2b_errorBuffer(512);
+  if (path == NULL || error == NULL) {
+    fprintf(stderr, "cannot allocate memory for profile output\n");
+    free(path);
+    if (error != NULL) {
+      pl2b_dropError(error);
+    }
+    return;
+  }
+
+  sprintf(path, "%s.txt", prefix);
+  pl2b_writeProfileReport(profile, path, error);
+  if (!pl2b_isError(error)) {
+    sprintf(path, "%s.folded", prefix);
+    pl2b_writeProfileFolded(profile, path, error);
+  }
+  if (pl2b_isError(error)) {
+    fprintf(stderr, "%s\n", error->reason);
+  }
+  free(path);
+  pl2b_dropError(error);
+}
+
+static int runBatch(const char *paths[],
+                    size_t pathCount,
+                    long jobs,
+                    _Bool pin,
+                    _Bool useCache,
+                    uint16_t flags,
+                    FILE *summary) {
+  Batch batch;
+  batch.items = (BatchItem*)calloc(pathCount + 1, sizeof(BatchItem));
+  batch.itemCount = pathCount;
+  batch.useCache = useCache;
+  batch.flags = flags;
+  batch.queueCap = (size_t)jobs * 2;
+  batch.queue = (size_t*)malloc(batch.queueCap * sizeof(size_t));
+  batch.queueHead = 0;
+  batch.queueSize = 0;
+  batch.nextItem = 0;
+  batch.parsing = 0;
+  BatchRunner *runners =
+    (BatchRunner*)malloc((size_t)jobs * sizeof(BatchRunner));
+  pthread_t *threads =
+    (pthread_t*)malloc((size_t)jobs * sizeof(pthread_t));
+  if (batch.items == NULL || batch.queue == NULL
+      || runners == NULL || threads == NULL) {
+    fprintf(stderr, "cannot allocate memory\n");
+    free(batch.items);
+    free(batch.queue);
+    free(runners);
+    free(threads);
+    return -1;
+  }
+  for (size_t i = 0; i < pathCount; i++) {
+    batch.items[i].path = paths[i];
+  }
+  pthread_mutex_init(&batch.lock, NULL);
+
+  long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+  uint64_t start = nanosNow();
+  long started = 0;
+  for (; started < jobs; started++) {
+    runners[started].batch = &batch;
+    runners[started].cpu = pin && cpuCount > 0 ? started % cpuCount : -1;
+    if (pthread_create(&threads[started], NULL,
+                       batchRunner, &runners[started]) != 0) {
+      break;
+    }
+  }
+  if (started == 0) {
+    fprintf(stderr, "cannot start batch threads, running on one\n");
+    runners[0].cpu = -1;
+    batchRunner(&runners[0]);
+  }
+  for (long i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  uint64_t elapsed = nanosNow() - start;
+
+  char mode[32];
+  snprintf(mode, sizeof(mode), "%ld jobs", jobs);
+  size_t failed = finishBatch(batch.items, pathCount, mode, elapsed,
+                              summary);
+  pthread_mutex_destroy(&batch.lock);
+  free(batch.items);
+  free(batch.queue);
+  free(runners);
+  free(threads);
+  return failed == 0 ? 0 : -1;
+}
+
+/* Runs all scripts on the main thread, switching between them while
+   they wait. All scripts are parsed before any starts running, and
+   `run_us` is wall time from then to finishing, waits and other scripts
+   included. */
+static int runEvents(const char *paths[],
+                     size_t pathCount,
+                     _Bool useCache,
+                     uint16_t flags,
+                     FILE *summary) {
+  BatchItem *items = (BatchItem*)calloc(pathCount + 1, sizeof(BatchItem));
+  pl2b_Error *error = pl2b_errorBuffer(512);
+  pl2b_Scheduler *scheduler =
+    error != NULL ? pl2b_createScheduler(error) : NULL;
+  if (items == NULL || scheduler == NULL) {
+    fprintf(stderr, "%s\n", error != NULL
+                            ? error->reason
+                            : "cannot allocate memory");
+    free(items);
+    if (error != NULL) {
+      pl2b_dropError(error);
+    }
+    return -1;
+  }
+
+  uint64_t start = nanosNow();
+  for (size_t i = 0; i < pathCount; i++) {
+    BatchItem *item = &items[i];
+    item->path = paths[i];
+    item->error = pl2b_errorBuffer(512);
+    if (item->error == NULL) {
+      continue;
+    }
+    uint64_t parseStart = nanosNow();
+    item->program = loadItem(item, useCache, flags);
+    item->parsed = !pl2b_isError(item->error);
+    item->parseNanos = nanosNow() - parseStart;
+  }
+  for (size_t i = 0; i < pathCount; i++) {
+    BatchItem *item = &items[i];
+    item->runNanos = nanosNow();
+    if (item->parsed && !pl2b_schedule(scheduler, &item->program,
+                                       item->error, eventDone, item)) {
+      item->runNanos = 0;
+      dropItem(item);
+    }
+  }
+  pl2b_runScheduler(scheduler, error);
+  if (pl2b_isError(error)) {
+    fprintf(stderr, "%s\n", error->reason);
+  }
+  pl2b_dropScheduler(scheduler);
+  uint64_t elapsed = nanosNow() - start;
+
+  size_t failed = finishBatch(items, pathCount, "1 event loop", elapsed,
+                              summary);
+  int ret = failed == 0 && !pl2b_isError(error) ? 0 : -1;
+  pl2b_dropError(error);
+  free(items);
+  return ret;
+}
+
+static void eventDone(pl2b_Program *program,
+                      pl2b_Error *error,
+                      void *item) {
+  (void)program;
+  (void)error;
+
+  BatchItem *batchItem = (BatchItem*)item;
+  batchItem->runNanos = nanosNow() - batchItem->runNanos;
+  dropItem(batchItem);
+}
+
+/* Writes summary and totals, then drops errors of all items. Returns
+   the number of failed scripts. */
+static size_t finishBatch(BatchItem *items,
+                          size_t count,
+                          const char *mode,
+                          uint64_t elapsed,
+                          FILE *summary) {
+  size_t failed = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (!items[i].parsed || pl2b_isError(items[i].error)) {
+      failed++;
+    }
+  }
+  writeSummary(summary, items, count);
+  fprintf(stderr, "batch: %zu scripts, %zu failed, %s, %.3f s\n",
+          count, failed, mode, (double)elapsed / 1e9);
+
+  for (size_t i = 0; i < count; i++) {
+    if (items[i].error != NULL) {
+      pl2b_dropError(items[i].error);
+    }
+  }
+  return failed;
+}
+
+/* A runner that finds nothing parsed ahead claims and parses the next
+   script itself. Once all scripts are claimed, whatever is still being
+   parsed ahead gets queued and run by the runner parsing it, so that an
+   empty queue means nothing is left for others. */
+static void *batchRunner(void *runner) {
+  BatchRunner *r = (BatchRunner*)runner;
+  Batch *b = r->batch;
+  if (r->cpu >= 0) {
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    CPU_SET((int)r->cpu, &cpuSet);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+  }
 
+  pthread_mutex_lock(&b->lock);
+  while (1) {
+    size_t idx;
+    if (b->queueSize != 0) {
+      idx = b->queue[b->queueHead];
+      b->queueHead = (b->queueHead + 1) % b->queueCap;
+      b->queueSize--;
+    } else if (b->nextItem < b->itemCount) {
+      idx = b->nextItem++;
+      pthread_mutex_unlock(&b->lock);
+      parseItem(b, &b->items[idx]);
+      pthread_mutex_lock(&b->lock);
+    } else {
+      pthread_mutex_unlock(&b->lock);
+      return NULL;
+    }
+
+    if (b->nextItem < b->itemCount
+        && b->queueSize + b->parsing < b->queueCap) {
+      size_t ahead = b->nextItem++;
+      b->parsing++;
+      pthread_mutex_unlock(&b->lock);
+      parseItem(b, &b->items[ahead]);
+      pthread_mutex_lock(&b->lock);
+      b->parsing--;
+      b->queue[(b->queueHead + b->queueSize) % b->queueCap] = ahead;
+      b->queueSize++;
+    }
+
+    pthread_mutex_unlock(&b->lock);
+    runItem(&b->items[idx]);
+    pthread_mutex_lock(&b->lock);
+  }
+}
+
+static void parseItem(Batch *b, BatchItem *item) {
+  uint64_t start = nanosNow();
+  item->error = pl2b_errorBuffer(512);
+  if (item->error != NULL) {
+    item->program = loadItem(item, b->useCache, b->flags);
+    item->parsed = !pl2b_isError(item->error);
+  }
+  item->parseNanos = nanosNow() - start;
+}
+
+static void runItem(BatchItem *item) {
+  if (item->parsed) {
+    uint64_t start = nanosNow();
+    pl2b_run(&item->program, item->error);
+    item->runNanos = nanosNow() - start;
+    dropItem(item);
+  }
+}
+
+/* One tab-separated line per script, in input order, after a header.
+   `status` is `ok`, `load_error` or `run_error`, with the error code,
+   line and reason of the failure; tabs and newlines within paths and
+   reasons are replaced with spaces. */
+static void writeSummary(FILE *fp, const BatchItem *items, size_t count) {
+  fprintf(fp, "index\tstatus\tcode\tline\tparse_us\trun_us\tpath"
+              "\treason\n");
+  for (size_t i = 0; i < count; i++) {
+    const BatchItem *item = &items[i];
+    const pl2b_Error *error = item->error;
+    const char *status = "ok";
+    if (!item->parsed) {
+      status = "load_error";
+    } else if (error->errorCode != PL2B_ERR_NONE) {
+      status = "run_error";
+    }
+    fprintf(fp, "%zu\t%s\t%u\t%u\t%llu\t%llu\t",
+            i, status,
+            error != NULL ? error->errorCode : PL2B_ERR_MALLOC,
+            error != NULL ? error->sourceInfo.line : 0,
+            (unsigned long long)(item->parseNanos / 1000),
+            (unsigned long long)(item->runNanos / 1000));
+    writeField(fp, item->path);
+    fputc('\t', fp);
+    if (error == NULL) {
+      writeField(fp, "cannot allocate memory");
+    } else if (error->errorCode != PL2B_ERR_NONE) {
+      writeField(fp, error->reason);
+    }
+    fputc('\n', fp);
+  }
+  fflush(fp);
+}
+
+static void writeField(FILE *fp, const char *str) {
+  for (; *str != '\0'; str++) {
+    fputc(*str == '\t' || *str == '\n' || *str == '\r' ? ' ' : *str, fp);
+  }
+}
+
+/* one path per line, skipping empty lines */
+static const char **readPathList(FILE *fp, size_t *count) {
+  size_t cap = 64;
+  const char **ret = (const char**)malloc(cap * sizeof(char*));
+  if (ret == NULL) {
+    return NULL;
+  }
+
+  *count = 0;
+  char *line = NULL;
+  size_t lineCap = 0;
+  ssize_t len;
+  while ((len = getline(&line, &lineCap, fp)) >= 0) {
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+      line[--len] = '\0';
+    }
+    if (len == 0) {
+      continue;
+    }
+    const char **newRet = ret;
+    if (*count == cap) {
+      newRet = (const char**)realloc((void*)ret, cap * 2 * sizeof(char*));
+      cap *= 2;
+    }
+    char *path = newRet != NULL ? strdup(line) : NULL;
+    if (path == NULL) {
+      /* a truncated list would silently skip scripts */
+      for (size_t i = 0; i < *count; i++) {
+        free((void*)ret[i]);
+      }
+      free(newRet != NULL ? (void*)newRet : (void*)ret);
+      free(line);
+      return NULL;
+    }
+    ret = newRet;
+    ret[(*count)++] = path;
+  }
+  free(line);
+  return ret;
+}
+
+static uint64_t nanosNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* Parses script at `path` with `flags`. With `useCache`, program is
+   loaded from `<script>c` image if that was built from the same source,
+   and the image is rebuilt otherwise. Unless `script` is given to keep
+   source alive for a program pointing into it, source is closed before
+   returning. */
+static pl2b_Program loadProgram(const char *path,
+                                Script *script,
+                                _Bool useCache,
+                                uint16_t flags,
+                                pl2b_Error *error) {
+  pl2b_Program program;
+  pl2b_initProgram(&program);
+
+  Script localScript;
+  if (script == NULL) {
+    script = &localScript;
+  }
+  if (openScript(path, script, error) != 0) {
+    return program;
+  }
+
+  char *cachePath = useCache ? imagePath(path) : NULL;
+  uint64_t sourceHash = 0;
+  _Bool cached = 0;
+  if (cachePath != NULL) {
+    sourceHash = pl2b_sourceHash(script->buffer, script->size);
+    cached = pl2b_loadProgramImage(cachePath, sourceHash, &program);
+  }
+
+  if (!cached) {
+    program = pl2b_parse4(script->buffer, 512, flags, error);
+    if (pl2b_isError(error)) {
+      /* drop what was parsed before the error */
+      pl2b_dropProgram(&program);
+      pl2b_initProgram(&program);
+    } else if (cachePath != NULL) {
+      pl2b_saveProgramImage(&program, sourceHash, cachePath, error);
+      if (pl2b_isError(error)) {
+        fprintf(stderr, "warning: %s\n", error->reason);
+        error->errorCode = PL2B_ERR_NONE;
+      }
+    }
+  }
+  free(cachePath);
+
+  /* program no longer refers to script source, unless it was given */
+  if (script == &localScript || pl2b_isError(error)) {
+    closeScript(script);
+  }
+  return program;
+}
+
+/* Loads script from `path`, or from stdin if `path` is `-`. Regular
+   files are mapped copy-on-write, since the parser writes into source,
+   and anything else is read into a heap buffer. Either way the buffer
+   is NUL-terminated. */
+static int openScript(const char *path,
+                      Script *script,
+                      pl2b_Error *error) {
+  int fd = strcmp(path, "-") ? open(path, O_RDONLY) : STDIN_FILENO;
+  if (fd < 0) {
+    pl2b_errPrintf(error, PL2B_ERR_GENERAL, pl2b_sourceInfo(path, 0),
+                   NULL, "cannot open input file %s", path);
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    pl2b_errPrintf(error, PL2B_ERR_GENERAL, pl2b_sourceInfo(path, 0),
+                   NULL, "cannot determine file size of %s", path);
+    if (fd != STDIN_FILENO) {
+      close(fd);
+    }
+    return -1;
+  }
+
+  int ret = -1;
+  if (S_ISREG(st.st_mode) && st.st_size > 0) {
+    ret = mapScript(fd, (size_t)st.st_size, script);
+  }
+  if (ret != 0) {
+    ret = readScript(fd, script);
+  }
+  if (ret != 0) {
+    pl2b_errPrintf(error, PL2B_ERR_GENERAL, pl2b_sourceInfo(path, 0),
+                   NULL, "cannot read file %s", path);
+  }
+
+  if (fd != STDIN_FILENO) {
+    close(fd);
+  }
+  return ret;
+}
+
+static int mapScript(int fd, size_t fileSize, Script *script) {
+  size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+  size_t mapSize = (fileSize + 1 + pageSize - 1) / pageSize * pageSize;
+
+  /* Reserve zeroed memory first and place the file over its beginning,
+     so there is always at least one NUL byte behind file content, even
+     if file size is a multiple of page size. */
+  char *reserved = (char*)mmap(NULL, mapSize, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (reserved == MAP_FAILED) {
+    return -1;
+  }
+  char *mapped = (char*)mmap(reserved, fileSize, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_FIXED, fd, 0);
+  if (mapped == MAP_FAILED) {
+    munmap(reserved, mapSize);
+    return -1;
+  }
+  madvise(mapped, fileSize, MADV_SEQUENTIAL);
+
+  script->buffer = mapped;
+  script->size = fileSize;
+  script->mapSize = mapSize;
+  return 0;
+}
+
+static int readScript(int fd, Script *script) {
+  size_t cap = 4096;
+  size_t size = 0;
+  char *buffer = (char*)malloc(cap);
+  if (buffer == NULL) {
+    return -1;
+  }
+
+  while (1) {
+    if (size + 1 == cap) {
+      char *newBuffer = (char*)realloc(buffer, cap * 2);
+      if (newBuffer == NULL) {
+        free(buffer);
+        return -1;
+      }
+      buffer = newBuffer;
+      cap *= 2;
+    }
+    ssize_t readSize = read(fd, buffer + size, cap - size - 1);
+    if (readSize < 0 && errno == EINTR) {
+      /* interrupted by a handler such as the one of `--trace` */
+      continue;
+    } else if (readSize < 0) {
+      free(buffer);
+      return -1;
+    } else if (readSize == 0) {
+      break;
+    }
+    size += (size_t)readSize;
+  }
+  buffer[size] = '\0';
+
+  script->buffer = buffer;
+  script->size = size;
+  script->mapSize = 0;
+  return 0;
+}
+
+static void closeScript(Script *script) {
+  if (script->mapSize != 0) {
+    munmap(script->buffer, script->mapSize);
+  } else {
+    free(script->buffer);
+  }
+}
+
+/* Batch programs are parsed densely; source only has to outlive them
+   when parts point into it, that is, without interning */
+static pl2b_Program loadItem(BatchItem *item,
+                             _Bool useCache,
+                             uint16_t flags) {
+  item->keepsSource = (flags & PL2B_PARSE_INTERN) == 0;
+  return loadProgram(item->path,
+                     item->keepsSource ? &item->script : NULL,
+                     useCache, flags, item->error);
+}
+
+static void dropItem(BatchItem *item) {
+  pl2b_dropProgram(&item->program);
+  if (item->keepsSource) {
+    closeScript(&item->script);
+  }
+}
+
+/* `script.pl2` caches into `script.pl2c`, other names get `.pl2c`
+   appended. Standard input is never cached. */
+static char *imagePath(const char *path) {
+  if (!strcmp(path, "-")) {
+    return NULL;
+  }
+  size_t len = strlen(path);
+  char *ret = (char*)malloc(len + 6);
+  if (ret == NULL) {
+    return NULL;
+  }
+  strcpy(ret, path);
+  if (len >= 4 && !strcmp(path + len - 4, ".pl2")) {
+    strcat(ret, "c");
+  } else {
+    strcat(ret, ".pl2c");
+  }
   return ret;
 }
@@ -3,11 +3,46 @@
 #include <assert.h>
 #include <ctype.h>
 #include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*** ------------------------ Static probes ------------------------ ***/
+
+/* USDT probes of provider `pl2b`, for bpftrace, perf or SystemTap to
+   attach to. With <sys/sdt.h> around, each probe is a single nop plus
+   a note telling where its arguments live, and costs nothing else until
+   attached; without it, or with PL2B_NO_PROBES, probes compile out.
+   The bpftrace scripts in examples/ show their arguments. */
+
+#if !defined(PL2B_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PL2B_PROBES
+#endif
+#endif
+
+#ifdef PL2B_PROBES
+#define PROBE2(name, a1, a2) DTRACE_PROBE2(pl2b, name, a1, a2)
+#define PROBE3(name, a1, a2, a3) DTRACE_PROBE3(pl2b, name, a1, a2, a3)
+#else
+#define PROBE2(name, a1, a2) ((void)(a1), (void)(a2))
+#define PROBE3(name, a1, a2, a3) ((void)(a1), (void)(a2), (void)(a3))
+#endif
 
 /*** ----------------- Implementation of versioning ---------------- ***/
 
@@ -55,13 +90,8 @@ static _Bool isNullSlice(Slice slice);
 
 Slice slice(char *start, char *end) {
   Slice ret;
-  if (start == end) {
-    ret.start = NULL;
-    ret.end = NULL;
-  } else {
-    ret.start = start;
-    ret.end = end;
-  }
+  ret.start = start;
+  ret.end = end;
   return ret;
 }
 
@@ -83,7 +113,305 @@ static char *sliceIntoCStr(Slice slice) {
 }
 
 static _Bool isNullSlice(Slice slice) {
-  return slice.start == slice.end;
+  return slice.start == NULL;
+}
+
+/*** ------------------- Implementation of arena ------------------- ***/
+
+#define ARENA_ALIGN          sizeof(void*)
+#define ARENA_MIN_BLOCK_SIZE ((size_t)64 * 1024)
+#define ARENA_MAX_BLOCK_SIZE ((size_t)16 * 1024 * 1024)
+
+typedef struct st_arena_block {
+  struct st_arena_block *next;
+  size_t size;
+  size_t usage;
+  char data[0];
+} ArenaBlock;
+
+typedef struct st_arena {
+  ArenaBlock *blocks;
+  size_t nextBlockSize;
+
+  /* file mapping commands refer to, unmapped together with blocks */
+  void *mapping;
+  size_t mappingSize;
+} Arena;
+
+static Arena *createArena(void);
+static void *arenaAlloc(Arena *arena, size_t size);
+static void arenaAdopt(Arena *arena, Arena *other);
+static const ArenaBlock *arenaBlockOf(const Arena *arena, const void *ptr);
+static _Bool arenaBlockHolds(const ArenaBlock *block, const void *ptr);
+static void dropArena(Arena *arena);
+
+static Arena *createArena(void) {
+  Arena *ret = (Arena*)malloc(sizeof(Arena));
+  if (ret == NULL) {
+    return NULL;
+  }
+  ret->blocks = NULL;
+  ret->nextBlockSize = ARENA_MIN_BLOCK_SIZE;
+  ret->mapping = NULL;
+  ret->mappingSize = 0;
+  return ret;
+}
+
+static void *arenaAlloc(Arena *arena, size_t size) {
+  size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+  ArenaBlock *block = arena->blocks;
+  if (block == NULL || block->size - block->usage < size) {
+    size_t blockSize = arena->nextBlockSize;
+    if (blockSize < size) {
+      blockSize = size;
+    }
+    block = (ArenaBlock*)malloc(sizeof(ArenaBlock) + blockSize);
+    if (block == NULL) {
+      return NULL;
+    }
+    block->next = arena->blocks;
+    block->size = blockSize;
+    block->usage = 0;
+    arena->blocks = block;
+    if (arena->nextBlockSize < ARENA_MAX_BLOCK_SIZE) {
+      arena->nextBlockSize *= 2;
+    }
+  }
+
+  void *ret = block->data + block->usage;
+  block->usage += size;
+  return ret;
+}
+
+/* Moves all blocks of `other` into `arena` and releases `other` */
+static void arenaAdopt(Arena *arena, Arena *other) {
+  assert(other->mapping == NULL);
+  if (other->blocks != NULL) {
+    ArenaBlock *last = other->blocks;
+    while (last->next != NULL) {
+      last = last->next;
+    }
+    last->next = arena->blocks;
+    arena->blocks = other->blocks;
+  }
+  free(other);
+}
+
+/* Block `ptr` got allocated from, or NULL if not from `arena` */
+static const ArenaBlock *arenaBlockOf(const Arena *arena, const void *ptr) {
+  for (const ArenaBlock *iter = arena->blocks;
+       iter != NULL;
+       iter = iter->next) {
+    if (arenaBlockHolds(iter, ptr)) {
+      return iter;
+    }
+  }
+  return NULL;
+}
+
+static _Bool arenaBlockHolds(const ArenaBlock *block, const void *ptr) {
+  uintptr_t addr = (uintptr_t)ptr;
+  uintptr_t start = (uintptr_t)block->data;
+  return addr >= start && addr - start < block->usage;
+}
+
+static void dropArena(Arena *arena) {
+  ArenaBlock *iter = arena->blocks;
+  while (iter != NULL) {
+    ArenaBlock *next = iter->next;
+    free(iter);
+    iter = next;
+  }
+  if (arena->mapping != NULL) {
+    munmap(arena->mapping, arena->mappingSize);
+  }
+  free(arena);
+}
+
+/*** ---------------- Implementation of symbol table --------------- ***/
+
+/* Interned strings live in an arena and never move, so that commands
+   may refer to them directly. Symbol ids are indices into `entries`
+   plus one, with builtin commands pre-interned at fixed ids. */
+
+#define SYMTAB_MIN_BUCKETS 256
+
+typedef struct st_symbol_entry {
+  const char *str;
+  size_t len;
+  uint64_t hash;
+} SymbolEntry;
+
+typedef struct st_symbol_table {
+  Arena *pool;
+  SymbolEntry *entries;
+  uint32_t entryCount;
+  uint32_t entryCap;
+  uint32_t *buckets; /* entry index plus one, 0 for empty bucket */
+  uint32_t bucketCount;
+} SymbolTable;
+
+static SymbolTable *createSymbolTable(void);
+static char *internStr(SymbolTable *table,
+                       const char *str,
+                       size_t len,
+                       uint32_t *symbol);
+static uint32_t findSymbol(const SymbolTable *table,
+                           const char *str,
+                           size_t len,
+                           uint64_t hash);
+static _Bool growSymbolTable(SymbolTable *table);
+static void dropSymbolTable(SymbolTable *table);
+static uint64_t symbolHash(const char *str, size_t len);
+
+static SymbolTable *createSymbolTable(void) {
+  SymbolTable *ret = (SymbolTable*)malloc(sizeof(SymbolTable));
+  if (ret == NULL) {
+    return NULL;
+  }
+  ret->pool = createArena();
+  ret->entries = NULL;
+  ret->entryCount = 0;
+  ret->entryCap = 0;
+  ret->bucketCount = SYMTAB_MIN_BUCKETS;
+  ret->buckets = (uint32_t*)calloc(ret->bucketCount, sizeof(uint32_t));
+  if (ret->pool == NULL || ret->buckets == NULL) {
+    dropSymbolTable(ret);
+    return NULL;
+  }
+
+  uint32_t symbol;
+  if (internStr(ret, "language", 8, &symbol) == NULL
+      || internStr(ret, "abort", 5, &symbol) == NULL) {
+    dropSymbolTable(ret);
+    return NULL;
+  }
+  assert(symbol == PL2B_SYM_ABORT);
+  return ret;
+}
+
+static char *internStr(SymbolTable *table,
+                       const char *str,
+                       size_t len,
+                       uint32_t *symbol) {
+  uint64_t hash = symbolHash(str, len);
+  uint32_t found = findSymbol(table, str, len, hash);
+  if (found != PL2B_SYM_NONE) {
+    *symbol = found;
+    return (char*)table->entries[found - 1].str;
+  }
+
+  if ((table->entryCount + 1) * 2 > table->bucketCount
+      || table->entryCount == table->entryCap) {
+    if (!growSymbolTable(table)) {
+      return NULL;
+    }
+  }
+  char *copy = (char*)arenaAlloc(table->pool, len + 1);
+  if (copy == NULL) {
+    return NULL;
+  }
+  memcpy(copy, str, len);
+  copy[len] = '\0';
+
+  SymbolEntry *entry = &table->entries[table->entryCount++];
+  entry->str = copy;
+  entry->len = len;
+  entry->hash = hash;
+  uint32_t mask = table->bucketCount - 1;
+  uint32_t idx = (uint32_t)hash & mask;
+  while (table->buckets[idx] != 0) {
+    idx = (idx + 1) & mask;
+  }
+  table->buckets[idx] = table->entryCount;
+  *symbol = table->entryCount;
+  return copy;
+}
+
+static uint32_t findSymbol(const SymbolTable *table,
+                           const char *str,
+                           size_t len,
+                           uint64_t hash) {
+  uint32_t mask = table->bucketCount - 1;
+  for (uint32_t idx = (uint32_t)hash & mask;
+       table->buckets[idx] != 0;
+       idx = (idx + 1) & mask) {
+    const SymbolEntry *entry = &table->entries[table->buckets[idx] - 1];
+    if (entry->hash == hash
+        && entry->len == len
+        && !memcmp(entry->str, str, len)) {
+      return table->buckets[idx];
+    }
+  }
+  return PL2B_SYM_NONE;
+}
+
+static _Bool growSymbolTable(SymbolTable *table) {
+  if (table->entryCount == table->entryCap) {
+    uint32_t newCap = table->entryCap == 0 ? 64 : table->entryCap * 2;
+    SymbolEntry *newEntries = (SymbolEntry*)realloc(
+      table->entries, newCap * sizeof(SymbolEntry)
+    );
+    if (newEntries == NULL) {
+      return 0;
+    }
+    table->entries = newEntries;
+    table->entryCap = newCap;
+  }
+
+  if ((table->entryCount + 1) * 2 > table->bucketCount) {
+    uint32_t newCount = table->bucketCount * 2;
+    uint32_t *newBuckets = (uint32_t*)calloc(newCount, sizeof(uint32_t));
+    if (newBuckets == NULL) {
+      return 0;
+    }
+    for (uint32_t i = 0; i < table->entryCount; i++) {
+      uint32_t idx = (uint32_t)table->entries[i].hash & (newCount - 1);
+      while (newBuckets[idx] != 0) {
+        idx = (idx + 1) & (newCount - 1);
+      }
+      newBuckets[idx] = i + 1;
+    }
+    free(table->buckets);
+    table->buckets = newBuckets;
+    table->bucketCount = newCount;
+  }
+  return 1;
+}
+
+static void dropSymbolTable(SymbolTable *table) {
+  if (table->pool != NULL) {
+    dropArena(table->pool);
+  }
+  free(table->entries);
+  free(table->buckets);
+  free(table);
+}
+
+static uint64_t symbolHash(const char *str, size_t len) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ transmuteU8(str[i])) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+uint32_t pl2b_lookupSymbol(const pl2b_Program *program, const char *str) {
+  const SymbolTable *table = (const SymbolTable*)program->symbols;
+  if (table == NULL) {
+    return PL2B_SYM_NONE;
+  }
+  size_t len = strlen(str);
+  return findSymbol(table, str, len, symbolHash(str, len));
+}
+
+const char *pl2b_symbolName(const pl2b_Program *program, uint32_t symbol) {
+  const SymbolTable *table = (const SymbolTable*)program->symbols;
+  if (table == NULL || symbol == PL2B_SYM_NONE
+      || symbol > table->entryCount) {
+    return NULL;
+  }
+  return table->entries[symbol - 1].str;
 }
 
 /*** ----------------- Implementation of pl2b_Error ---------------- ***/
@@ -107,14 +435,14 @@ void pl2b_errPrintf(pl2b_Error *error,
   error->errorCode = errorCode;
   error->extraData = extraData;
   error->sourceInfo = sourceInfo;
-  if (error->errorBufferSize == 0) {
-    return;
+  if (error->errorBufferSize != 0) {
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(error->reason, error->errorBufferSize, fmt, ap);
+    va_end(ap);
   }
-
-  va_list ap;
-  va_start(ap, fmt);
-  vsnprintf(error->reason, error->errorBufferSize, fmt, ap);
-  va_end(ap);
+  PROBE3(error, errorCode, sourceInfo.line,
+         error->errorBufferSize != 0 ? error->reason : "");
 }
 
 void pl2b_dropError(pl2b_Error *error) {
@@ -130,7 +458,12 @@ _Bool pl2b_isError(pl2b_Error *error) {
 
 /*** ------------------- Some toolkit functions -------------------- ***/
 
-pl2b_SourceInfo pl2b_sourceInfo(const char *fileName, uint16_t line) {
+/* last id given to a command, so that ids start from 1 */
+static _Atomic uint64_t lastCmdId;
+
+static uint64_t newCmdId(void);
+
+pl2b_SourceInfo pl2b_sourceInfo(const char *fileName, uint32_t line) {
   pl2b_SourceInfo ret;
   ret.fileName = fileName;
   ret.line = line;
@@ -138,7 +471,29 @@ pl2b_SourceInfo pl2b_sourceInfo(const char *fileName, uint16_t line) {
 }
 
 pl2b_CmdPart pl2b_cmdPart(char *str, _Bool isString) {
-  return (pl2b_CmdPart) { str, isString };
+  return pl2b_cmdPart3(str, str != NULL ? strlen(str) : 0, isString);
+}
+
+pl2b_CmdPart pl2b_cmdPart3(char *str, size_t len, _Bool isString) {
+  pl2b_CmdPart ret;
+  ret.str = str;
+  ret.len = len > PL2B_PART_MAX_LEN ? PL2B_PART_MAX_LEN : (uint32_t)len;
+  ret.isString = isString;
+  ret.symbol = PL2B_SYM_NONE;
+  return ret;
+}
+
+pl2b_CmdPart pl2b_cmdPart4(char *str,
+                           size_t len,
+                           _Bool isString,
+                           pl2b_Error *error) {
+  if (len > PL2B_PART_MAX_LEN) {
+    pl2b_errPrintf(error, PL2B_ERR_GENERAL, (pl2b_SourceInfo) {},
+                   NULL, "command part exceeds %u bytes",
+                   (unsigned)PL2B_PART_MAX_LEN);
+    return pl2b_cmdPart(NULL, 0);
+  }
+  return pl2b_cmdPart3(str, len, isString);
 }
 
 pl2b_Cmd *pl2b_cmd3(pl2b_SourceInfo sourceInfo,
@@ -153,7 +508,7 @@ pl2b_Cmd *pl2b_cmd6(pl2b_Cmd *prev,
                     pl2b_SourceInfo sourceInfo,
                     pl2b_CmdPart cmd,
                     pl2b_CmdPart args[]) {
-  uint16_t argLen = 0;
+  uint32_t argLen = 0;
   for (; !PL2B_EMPTY_PART(args[argLen]); ++argLen);
 
   pl2b_Cmd *ret = (pl2b_Cmd*)malloc(sizeof(pl2b_Cmd) +
@@ -161,6 +516,7 @@ pl2b_Cmd *pl2b_cmd6(pl2b_Cmd *prev,
   if (ret == NULL) {
     return NULL;
   }
+  ret->args = (pl2b_CmdPart*)(ret + 1);
   ret->prev = prev;
   if (prev != NULL) {
     prev->next = ret;
@@ -171,36 +527,79 @@ pl2b_Cmd *pl2b_cmd6(pl2b_Cmd *prev,
   }
   ret->sourceInfo = sourceInfo;
   ret->cmd = cmd;
-  ret->resolveCache = NULL;
   ret->extraData = extraData;
-  for (uint16_t i = 0; i < argLen; i++) {
+  ret->argc = argLen;
+  ret->group = 0;
+  ret->id = newCmdId();
+  for (uint32_t i = 0; i < argLen; i++) {
     ret->args[i] = args[i];
   }
   ret->args[argLen] = pl2b_cmdPart(NULL, 0);
   return ret;
 }
 
-uint16_t pl2b_argsLen(pl2b_Cmd *cmd) {
-  uint16_t acc = 0;
-  pl2b_CmdPart *iter = cmd->args;
-  while (!PL2B_EMPTY_PART(*iter)) {
-    iter++;
-    acc++;
-  }
-  return acc;
+uint32_t pl2b_argsLen(pl2b_Cmd *cmd) {
+  return cmd->argc;
+}
+
+static uint64_t newCmdId(void) {
+  return atomic_fetch_add_explicit(&lastCmdId, 1, memory_order_relaxed) + 1;
 }
 
 /*** ---------------- Implementation of pl2b_Program --------------- ***/
 
+typedef struct st_lazy_program LazyProgram;
+
+static void dropForeignCmds(pl2b_Program *program);
+static _Bool isLazyError(const pl2b_Program *program, const pl2b_Cmd *cmd);
+static void dropLazyProgram(LazyProgram *lazy);
+
 void pl2b_initProgram(pl2b_Program *program) {
   program->commands = NULL;
+  program->arena = NULL;
+  program->symbols = NULL;
+  program->cmdCount = 0;
+  program->lazy = NULL;
 }
 
 void pl2b_dropProgram(pl2b_Program *program) {
+  if (program->arena != NULL) {
+    dropForeignCmds(program);
+    dropArena((Arena*)program->arena);
+  } else {
+    pl2b_Cmd *iter = program->commands;
+    while (iter != NULL) {
+      pl2b_Cmd *next = iter->next;
+      free(iter);
+      iter = next;
+    }
+  }
+
+  if (program->symbols != NULL) {
+    dropSymbolTable((SymbolTable*)program->symbols);
+  }
+  if (program->lazy != NULL) {
+    dropLazyProgram((LazyProgram*)program->lazy);
+  }
+}
+
+/* Frees commands that languages linked into an arena program with
+   pl2b_cmd3/pl2b_cmd6. Neighbours mostly share their block, so the block
+   of the last arena command is tried first. */
+static void dropForeignCmds(pl2b_Program *program) {
+  const Arena *arena = (const Arena*)program->arena;
+  const ArenaBlock *block = NULL;
   pl2b_Cmd *iter = program->commands;
-  while (iter != NULL) {
+  while (iter != NULL && !isLazyError(program, iter)) {
     pl2b_Cmd *next = iter->next;
-    free(iter);
+    if (block == NULL || !arenaBlockHolds(block, iter)) {
+      const ArenaBlock *owner = arenaBlockOf(arena, iter);
+      if (owner != NULL) {
+        block = owner;
+      } else {
+        free(iter);
+      }
+    }
     iter = next;
   }
 }
@@ -214,7 +613,7 @@ void pl2b_debugPrintProgram(const pl2b_Program *program) {
     } else {
       fprintf(stderr, "\t%s [", cmd->cmd.str);
     }
-    for (uint16_t i = 0; !PL2B_EMPTY_PART(cmd->args[i]); i++) {
+    for (uint32_t i = 0; !PL2B_EMPTY_PART(cmd->args[i]); i++) {
       pl2b_CmdPart arg = cmd->args[i];
       if (arg.isString) {
         fprintf(stderr, "\"%s\", ", arg.str);
@@ -228,6 +627,291 @@ void pl2b_debugPrintProgram(const pl2b_Program *program) {
   fprintf(stderr, "end program commands\n");
 }
 
+size_t pl2b_cmdIndex(const pl2b_Program *program, const pl2b_Cmd *cmd) {
+  if (cmd < program->commands
+      || cmd >= program->commands + program->cmdCount) {
+    return PL2B_NO_INDEX;
+  }
+  return (size_t)(cmd - program->commands);
+}
+
+/*** ------------------ Implementation of scanner ------------------ ***/
+
+/* The scanner functions below find the first byte that stops a run of
+   identifier characters, whitespaces, comment or string content. The
+   source is always NUL-terminated and NUL stops every run, so vector
+   variants only use aligned loads, which never cross a page boundary
+   and hence never fault even when reading past the terminator. */
+
+typedef const char *(ScanStub)(const char *src);
+typedef size_t (CountStub)(const char *start, const char *end);
+
+typedef struct st_scanner {
+  const char *name;
+  ScanStub *idRun;
+  ScanStub *whitespaceRun;
+  ScanStub *lineEnd;
+  ScanStub *strStop;
+  CountStub *countNewlines;
+} Scanner;
+
+static const Scanner *getScanner(void);
+
+static _Bool isIdChar(char ch);
+
+static const char *scalarIdRun(const char *src) {
+  while (isIdChar(*src)) {
+    src++;
+  }
+  return src;
+}
+
+static const char *scalarWhitespaceRun(const char *src) {
+  while (1) {
+    switch (*src) {
+    case ' ': case '\t': case '\f': case '\v': case '\r':
+      src++;
+      break;
+    default:
+      return src;
+    }
+  }
+}
+
+static const char *scalarLineEnd(const char *src) {
+  while (*src != '\0' && *src != '\n') {
+    src++;
+  }
+  return src;
+}
+
+static const char *scalarStrStop(const char *src) {
+  while (1) {
+    switch (*src) {
+    case '"': case '\'': case '\\': case '\n': case '\0':
+      return src;
+    default:
+      src++;
+    }
+  }
+}
+
+static size_t scalarCountNewlines(const char *start, const char *end) {
+  size_t count = 0;
+  while ((start = (const char*)memchr(start, '\n',
+                                     (size_t)(end - start))) != NULL) {
+    count++;
+    start++;
+  }
+  return count;
+}
+
+static const Scanner scalarScanner = {
+  "scalar",
+  scalarIdRun,
+  scalarWhitespaceRun,
+  scalarLineEnd,
+  scalarStrStop,
+  scalarCountNewlines
+};
+
+#if !defined(PL2B_NO_SIMD) \
+    && defined(__GNUC__) \
+    && defined(__SSE2__) \
+    && (defined(__x86_64__) || defined(__i386__))
+#define PL2B_SIMD_X86
+#endif
+
+#ifdef PL2B_SIMD_X86
+#include <immintrin.h>
+
+/* Given a function computing the "stop" mask of one vector, defines a
+   scanner function returning the first stopping byte. Reading past the
+   terminator is intended, so these are excluded from ASan checks. */
+#define DEFINE_VEC_SCAN(ATTR, NAME, VEC, WIDTH, LOAD, MASK) \
+  ATTR __attribute__((no_sanitize_address)) \
+  static const char *NAME(const char *src) { \
+    uintptr_t misalign = (uintptr_t)src & (WIDTH - 1); \
+    const VEC *iter = (const VEC*)(const void*)(src - misalign); \
+    uint32_t mask = MASK(LOAD(iter)) >> misalign; \
+    if (mask != 0) { \
+      return src + __builtin_ctz(mask); \
+    } \
+    while (1) { \
+      iter++; \
+      mask = MASK(LOAD(iter)); \
+      if (mask != 0) { \
+        return (const char*)(const void*)iter + __builtin_ctz(mask); \
+      } \
+    } \
+  }
+
+#define SSE2_EQ(v, ch) _mm_cmpeq_epi8((v), _mm_set1_epi8(ch))
+#define SSE2_MOVEMASK(v) ((uint32_t)_mm_movemask_epi8(v))
+
+static uint32_t sse2NonIdMask(__m128i v) {
+  /* control characters and space, `0x7f`, `"`, `#` and `\``; bytes
+     above 127 are negative and hence identifier characters */
+  __m128i ctrl = _mm_andnot_si128(_mm_cmplt_epi8(v, _mm_setzero_si128()),
+                                  _mm_cmplt_epi8(v, _mm_set1_epi8(0x21)));
+  __m128i punct = _mm_or_si128(_mm_or_si128(SSE2_EQ(v, 0x7f),
+                                            SSE2_EQ(v, '"')),
+                               _mm_or_si128(SSE2_EQ(v, '#'),
+                                            SSE2_EQ(v, '`')));
+  return SSE2_MOVEMASK(_mm_or_si128(ctrl, punct));
+}
+
+static uint32_t sse2NonWhitespaceMask(__m128i v) {
+  __m128i ws = _mm_or_si128(_mm_or_si128(SSE2_EQ(v, ' '),
+                                         SSE2_EQ(v, '\t')),
+                            _mm_or_si128(_mm_or_si128(SSE2_EQ(v, '\v'),
+                                                      SSE2_EQ(v, '\f')),
+                                         SSE2_EQ(v, '\r')));
+  return SSE2_MOVEMASK(ws) ^ 0xffffu;
+}
+
+static uint32_t sse2LineEndMask(__m128i v) {
+  return SSE2_MOVEMASK(_mm_or_si128(SSE2_EQ(v, '\n'), SSE2_EQ(v, '\0')));
+}
+
+static uint32_t sse2StrStopMask(__m128i v) {
+  __m128i quote = _mm_or_si128(SSE2_EQ(v, '"'), SSE2_EQ(v, '\''));
+  __m128i other = _mm_or_si128(SSE2_EQ(v, '\\'),
+                               _mm_or_si128(SSE2_EQ(v, '\n'),
+                                            SSE2_EQ(v, '\0')));
+  return SSE2_MOVEMASK(_mm_or_si128(quote, other));
+}
+
+DEFINE_VEC_SCAN(, sse2IdRun, __m128i, 16, _mm_load_si128, sse2NonIdMask)
+DEFINE_VEC_SCAN(, sse2WhitespaceRun, __m128i, 16, _mm_load_si128,
+                sse2NonWhitespaceMask)
+DEFINE_VEC_SCAN(, sse2LineEnd, __m128i, 16, _mm_load_si128,
+                sse2LineEndMask)
+DEFINE_VEC_SCAN(, sse2StrStop, __m128i, 16, _mm_load_si128,
+                sse2StrStopMask)
+
+/* Unlike scanners above, counts within explicit bounds, hence only uses
+   unaligned loads which stay inside the range */
+static size_t sse2CountNewlines(const char *start, const char *end) {
+  size_t count = 0;
+  __m128i newline = _mm_set1_epi8('\n');
+  for (; end - start >= 16; start += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(const void*)start);
+    count += (size_t)__builtin_popcount(
+      SSE2_MOVEMASK(_mm_cmpeq_epi8(v, newline))
+    );
+  }
+  return count + scalarCountNewlines(start, end);
+}
+
+static const Scanner sse2Scanner = {
+  "sse2",
+  sse2IdRun,
+  sse2WhitespaceRun,
+  sse2LineEnd,
+  sse2StrStop,
+  sse2CountNewlines
+};
+
+#define AVX2_ATTR __attribute__((target("avx2")))
+#define AVX2_EQ(v, ch) _mm256_cmpeq_epi8((v), _mm256_set1_epi8(ch))
+#define AVX2_MOVEMASK(v) ((uint32_t)_mm256_movemask_epi8(v))
+
+AVX2_ATTR static uint32_t avx2NonIdMask(__m256i v) {
+  __m256i ctrl = _mm256_andnot_si256(
+    _mm256_cmpgt_epi8(_mm256_setzero_si256(), v),
+    _mm256_cmpgt_epi8(_mm256_set1_epi8(0x21), v)
+  );
+  __m256i punct = _mm256_or_si256(_mm256_or_si256(AVX2_EQ(v, 0x7f),
+                                                  AVX2_EQ(v, '"')),
+                                  _mm256_or_si256(AVX2_EQ(v, '#'),
+                                                  AVX2_EQ(v, '`')));
+  return AVX2_MOVEMASK(_mm256_or_si256(ctrl, punct));
+}
+
+AVX2_ATTR static uint32_t avx2NonWhitespaceMask(__m256i v) {
+  __m256i ws = _mm256_or_si256(
+    _mm256_or_si256(AVX2_EQ(v, ' '), AVX2_EQ(v, '\t')),
+    _mm256_or_si256(_mm256_or_si256(AVX2_EQ(v, '\v'), AVX2_EQ(v, '\f')),
+                    AVX2_EQ(v, '\r'))
+  );
+  return ~AVX2_MOVEMASK(ws);
+}
+
+AVX2_ATTR static uint32_t avx2LineEndMask(__m256i v) {
+  return AVX2_MOVEMASK(_mm256_or_si256(AVX2_EQ(v, '\n'),
+                                       AVX2_EQ(v, '\0')));
+}
+
+AVX2_ATTR static uint32_t avx2StrStopMask(__m256i v) {
+  __m256i quote = _mm256_or_si256(AVX2_EQ(v, '"'), AVX2_EQ(v, '\''));
+  __m256i other = _mm256_or_si256(AVX2_EQ(v, '\\'),
+                                  _mm256_or_si256(AVX2_EQ(v, '\n'),
+                                                  AVX2_EQ(v, '\0')));
+  return AVX2_MOVEMASK(_mm256_or_si256(quote, other));
+}
+
+DEFINE_VEC_SCAN(AVX2_ATTR, avx2IdRun, __m256i, 32, _mm256_load_si256,
+                avx2NonIdMask)
+DEFINE_VEC_SCAN(AVX2_ATTR, avx2WhitespaceRun, __m256i, 32,
+                _mm256_load_si256, avx2NonWhitespaceMask)
+DEFINE_VEC_SCAN(AVX2_ATTR, avx2LineEnd, __m256i, 32, _mm256_load_si256,
+                avx2LineEndMask)
+DEFINE_VEC_SCAN(AVX2_ATTR, avx2StrStop, __m256i, 32, _mm256_load_si256,
+                avx2StrStopMask)
+
+__attribute__((target("avx2,popcnt")))
+static size_t avx2CountNewlines(const char *start, const char *end) {
+  size_t count = 0;
+  __m256i newline = _mm256_set1_epi8('\n');
+  for (; end - start >= 32; start += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(const void*)start);
+    count += (size_t)__builtin_popcount(
+      AVX2_MOVEMASK(_mm256_cmpeq_epi8(v, newline))
+    );
+  }
+  return count + scalarCountNewlines(start, end);
+}
+
+static const Scanner avx2Scanner = {
+  "avx2",
+  avx2IdRun,
+  avx2WhitespaceRun,
+  avx2LineEnd,
+  avx2StrStop,
+  avx2CountNewlines
+};
+#endif /* PL2B_SIMD_X86 */
+
+/* Picks the widest scanner supported by running CPU. Environment
+   variable `PL2B_SCANNER` may force one by its name. */
+static const Scanner *getScanner(void) {
+  const Scanner *candidates[] = {
+#ifdef PL2B_SIMD_X86
+    __builtin_cpu_supports("avx2") ? &avx2Scanner : NULL,
+    &sse2Scanner,
+#endif
+    &scalarScanner
+  };
+  size_t candidateCount = sizeof(candidates) / sizeof(candidates[0]);
+
+  const Scanner *selected = NULL;
+  const char *forced = getenv("PL2B_SCANNER");
+  for (size_t i = 0; i < candidateCount; i++) {
+    if (candidates[i] == NULL) {
+      continue;
+    }
+    if (forced == NULL || !strcmp(forced, candidates[i]->name)) {
+      selected = candidates[i];
+      break;
+    }
+  }
+  if (selected == NULL) {
+    selected = &scalarScanner;
+  }
+  return selected;
+}
+
 /*** ----------------- Implementation of pl2b_parse ---------------- ***/
 
 typedef enum e_parse_mode {
@@ -237,8 +921,10 @@ typedef enum e_parse_mode {
 
 typedef enum e_ques_cmd {
   QUES_INVALID = 0,
-  QUES_BEGIN   = 1,
-  QUES_END     = 2
+  QUES_BEGIN    = 1,
+  QUES_END      = 2,
+  QUES_PARALLEL = 3,
+  QUES_JOIN     = 4
 } QuesCmd;
 
 typedef struct st_parsed_part_cache {
@@ -249,94 +935,252 @@ typedef struct st_parsed_part_cache {
 typedef struct st_parse_context {
   pl2b_Program program;
   pl2b_Cmd *listTail;
+  pl2b_Cmd *denseCmds;    /* grown while parsing, then moved to arena */
+  size_t denseCmdUsage;
+  size_t denseCmdSize;
+  pl2b_CmdPart *denseParts;
+  size_t densePartUsage;
+  size_t densePartSize;
+  Arena *arena;
+  SymbolTable *symbols;
+  const Scanner *scanner;
+  _Bool ownStrings;
 
   char *src;
-  uint32_t srcIdx;
+  size_t srcIdx;
   ParseMode mode;
+  uint32_t group;         /* line of open `?parallel`, or 0 */
+  _Bool openEnded;        /* more source may follow, as for streams */
 
   pl2b_SourceInfo sourceInfo;
+  pl2b_SourceInfo cmdSourceInfo;
 
   uint32_t parseBufferSize;
   uint32_t parseBufferUsage;
-  ParsedPartCache parseBuffer[0];
+  ParsedPartCache *parseBuffer;
 } ParseContext;
 
+#define PARSE_BUFFER_MIN_SIZE 16
+#define DENSE_MIN_SIZE        256
+
 static ParseContext *createParseContext(char *src,
-                                        uint16_t parseBufferSize);
+                                        uint16_t parseBufferSize,
+                                        _Bool useArena);
+static void dropParseContext(ParseContext *ctx);
+static void parseAll(ParseContext *ctx, pl2b_Error *error);
+static void parseNextCmd(ParseContext *ctx, pl2b_Error *error);
+static void checkParseEnd(ParseContext *ctx, pl2b_Error *error);
+static pl2b_Program startLazyProgram(ParseContext *ctx, pl2b_Error *error);
 static void parseLine(ParseContext *ctx, pl2b_Error *error);
+static QuesCmd quesCmdFromStr(const char *str, size_t len);
 static void parseQuesMark(ParseContext *ctx, pl2b_Error *error);
 static void parsePart(ParseContext *ctx, pl2b_Error *error);
 static Slice parseId(ParseContext *ctx, pl2b_Error *error);
 static Slice parseStr(ParseContext *ctx, pl2b_Error *error);
-static void checkBufferSize(ParseContext *ctx, pl2b_Error *error);
+static void growParseBuffer(ParseContext *ctx, pl2b_Error *error);
 static void finishLine(ParseContext *ctx, pl2b_Error *error);
-static pl2b_Cmd *cmdFromSlices2(pl2b_SourceInfo sourceInfo,
-                                ParsedPartCache *parts);
-static pl2b_Cmd *cmdFromSlices5(pl2b_Cmd *prev,
+static _Bool appendDenseCmd(ParseContext *ctx,
+                            pl2b_SourceInfo sourceInfo,
+                            ParsedPartCache *parts,
+                            uint32_t partCount);
+static void finishDenseCmds(ParseContext *ctx, pl2b_Error *error);
+static _Bool fillCmdParts(ParseContext *ctx,
+                          pl2b_Cmd *cmd,
+                          ParsedPartCache *parts,
+                          uint32_t partCount,
+                          char *strPool);
+static pl2b_Cmd *cmdFromSlices3(ParseContext *ctx,
+                                pl2b_SourceInfo sourceInfo,
+                                ParsedPartCache *parts,
+                                uint32_t partCount);
+static pl2b_Cmd *cmdFromSlices6(ParseContext *ctx,
+                                pl2b_Cmd *prev,
                                 pl2b_Cmd *next,
                                 void *extraData,
                                 pl2b_SourceInfo sourceInfo,
-                                ParsedPartCache *parts);
+                                ParsedPartCache *parts,
+                                uint32_t partCount);
 static void skipWhitespace(ParseContext *ctx);
 static void skipComment(ParseContext *ctx);
 static char curChar(ParseContext *ctx);
 static char *curCharPos(ParseContext *ctx);
 static void nextChar(ParseContext *ctx);
+static void skipTo(ParseContext *ctx, const char *pos);
 static _Bool isIdChar(char ch);
-static _Bool isLineEnd(char ch);
 static char *shrinkConv(char *start, char *end);
 
 pl2b_Program pl2b_parse(char *source,
                         uint16_t parseBufferSize,
                         pl2b_Error *error) {
-  ParseContext *context = createParseContext(source, parseBufferSize);
+  return pl2b_parse4(source, parseBufferSize, 0, error);
+}
+
+pl2b_Program pl2b_parseArena(char *source,
+                             uint16_t parseBufferSize,
+                             pl2b_Error *error) {
+  return pl2b_parse4(source, parseBufferSize, PL2B_PARSE_ARENA, error);
+}
+
+pl2b_Program pl2b_parse4(char *source,
+                         uint16_t parseBufferSize,
+                         uint16_t flags,
+                         pl2b_Error *error) {
+  PROBE2(parse_start, source, flags);
+  ParseContext *context =
+    createParseContext(source, parseBufferSize,
+                       (flags & (PL2B_PARSE_ARENA
+                                 | PL2B_PARSE_DENSE
+                                 | PL2B_PARSE_LAZY)) != 0);
+  if (context != NULL
+      && (flags & PL2B_PARSE_DENSE) != 0
+      && (flags & PL2B_PARSE_LAZY) == 0) {
+    context->denseCmds = (pl2b_Cmd*)malloc(
+      context->denseCmdSize * sizeof(pl2b_Cmd)
+    );
+    context->denseParts = (pl2b_CmdPart*)malloc(
+      context->densePartSize * sizeof(pl2b_CmdPart)
+    );
+    if (context->denseCmds == NULL || context->denseParts == NULL) {
+      dropArena(context->arena);
+      dropParseContext(context);
+      context = NULL;
+    }
+  }
+  if (context != NULL && (flags & PL2B_PARSE_INTERN) != 0) {
+    context->symbols = createSymbolTable();
+    if (context->symbols == NULL) {
+      if (context->arena != NULL) {
+        dropArena(context->arena);
+      }
+      dropParseContext(context);
+      context = NULL;
+    } else {
+      context->program.symbols = context->symbols;
+    }
+  }
   if (context == NULL) {
     pl2b_errPrintf(error,
                    PL2B_ERR_MALLOC,
                    (pl2b_SourceInfo) {},
                    NULL,
                    "allocation failure");
-    return (pl2b_Program) { NULL };
+    PROBE2(parse_done, source, error->errorCode);
+    return (pl2b_Program) { NULL, NULL, NULL, 0, NULL };
   }
 
-  while (curChar(context) != '\0') {
-    parseLine(context, error);
-    if (pl2b_isError(error)) {
-      break;
-    }
+  if ((flags & PL2B_PARSE_LAZY) != 0) {
+    /* only the first command gets parsed here */
+    pl2b_Program ret = startLazyProgram(context, error);
+    PROBE2(parse_done, source, error->errorCode);
+    return ret;
+  }
+
+  parseAll(context, error);
+  if (context->denseCmds != NULL) {
+    finishDenseCmds(context, error);
   }
 
   pl2b_Program ret = context->program;
-  free(context);
+  dropParseContext(context);
+  PROBE2(parse_done, source, error->errorCode);
   return ret;
 }
 
+/* `parseBufferSize` is only the initial capacity of part buffer, which
+   grows as long commands require */
 static ParseContext *createParseContext(char *src,
-                                        uint16_t parseBufferSize) {
-  if (parseBufferSize == 0) {
+                                        uint16_t parseBufferSize,
+                                        _Bool useArena) {
+  ParseContext *ret = (ParseContext*)malloc(sizeof(ParseContext));
+  if (ret == NULL) {
     return NULL;
   }
 
-  ParseContext *ret = (ParseContext*)malloc(
-    sizeof(ParseContext) + parseBufferSize * sizeof(Slice)
+  ret->parseBufferSize = parseBufferSize < PARSE_BUFFER_MIN_SIZE
+                         ? PARSE_BUFFER_MIN_SIZE
+                         : parseBufferSize;
+  ret->parseBufferUsage = 0;
+  ret->parseBuffer = (ParsedPartCache*)malloc(
+    ret->parseBufferSize * sizeof(ParsedPartCache)
   );
-  if (ret == NULL) {
+  if (ret->parseBuffer == NULL) {
+    free(ret);
     return NULL;
   }
 
   pl2b_initProgram(&ret->program);
   ret->listTail = NULL;
+  ret->denseCmds = NULL;
+  ret->denseCmdUsage = 0;
+  ret->denseCmdSize = DENSE_MIN_SIZE;
+  ret->denseParts = NULL;
+  ret->densePartUsage = 0;
+  ret->densePartSize = DENSE_MIN_SIZE * 4;
+  ret->arena = NULL;
+  ret->symbols = NULL;
+  ret->scanner = getScanner();
+  ret->ownStrings = 0;
+  if (useArena) {
+    ret->arena = createArena();
+    if (ret->arena == NULL) {
+      dropParseContext(ret);
+      return NULL;
+    }
+    ret->program.arena = ret->arena;
+  }
   ret->src = src;
   ret->srcIdx = 0;
   ret->sourceInfo = pl2b_sourceInfo("<unknown-file>", 1);
+  ret->cmdSourceInfo = ret->sourceInfo;
   ret->mode = PARSE_SINGLE_LINE;
-
-  ret->parseBufferSize = parseBufferSize;
-  ret->parseBufferUsage = 0;
-  memset(ret->parseBuffer, 0, parseBufferSize * sizeof(Slice));
+  ret->group = 0;
+  ret->openEnded = 0;
   return ret;
 }
 
+/* Does not drop the arena, which belongs to parsed program */
+static void dropParseContext(ParseContext *ctx) {
+  free(ctx->denseCmds);
+  free(ctx->denseParts);
+  free(ctx->parseBuffer);
+  free(ctx);
+}
+
+static void parseAll(ParseContext *ctx, pl2b_Error *error) {
+  while (curChar(ctx) != '\0') {
+    parseLine(ctx, error);
+    if (pl2b_isError(error)) {
+      return;
+    }
+  }
+  checkParseEnd(ctx, error);
+}
+
+/* Parses until one more command is complete or source ends */
+static void parseNextCmd(ParseContext *ctx, pl2b_Error *error) {
+  pl2b_Cmd *listTail = ctx->listTail;
+  while (ctx->listTail == listTail && curChar(ctx) != '\0') {
+    parseLine(ctx, error);
+    if (pl2b_isError(error)) {
+      return;
+    }
+  }
+  if (curChar(ctx) == '\0') {
+    checkParseEnd(ctx, error);
+  }
+}
+
+static void checkParseEnd(ParseContext *ctx, pl2b_Error *error) {
+  if (ctx->mode == PARSE_MULTI_LINE) {
+    pl2b_errPrintf(error, PL2B_ERR_UNCLOSED_BEGIN, ctx->sourceInfo,
+                   NULL, "unclosed `?begin` block");
+  } else if (ctx->group != 0 && !ctx->openEnded) {
+    pl2b_errPrintf(error, PL2B_ERR_PARALLEL, ctx->sourceInfo,
+                   NULL, "unclosed `?parallel` block opened at line %u",
+                   ctx->group);
+  }
+}
+
 static void parseLine(ParseContext *ctx, pl2b_Error *error) {
   if (curChar(ctx) == '?') {
     parseQuesMark(ctx, error);
@@ -347,16 +1191,15 @@ static void parseLine(ParseContext *ctx, pl2b_Error *error) {
 
   while (1) {
     skipWhitespace(ctx);
-    if (curChar(ctx) == '\0' || curChar(ctx) == '\n') {
+    char lineEnd = curChar(ctx);
+    if (lineEnd == '\0' || lineEnd == '\n') {
+      /* finishing the line may overwrite the newline with NUL */
       if (ctx->mode == PARSE_SINGLE_LINE) {
         finishLine(ctx, error);
       }
-      if (ctx->mode == PARSE_MULTI_LINE && curChar(ctx) == '\0') {
-        pl2b_errPrintf(error, PL2B_ERR_UNCLOSED_BEGIN, ctx->sourceInfo,
-                       NULL, "unclosed `?begin` block");
-      }
-      if (curChar(ctx) == '\n') {
-        nextChar(ctx);
+      if (lineEnd == '\n') {
+        ctx->sourceInfo.line += 1;
+        ctx->srcIdx += 1;
       }
       return;
     } else if (curChar(ctx) == '#') {
@@ -375,25 +1218,64 @@ static void parseQuesMark(ParseContext *ctx, pl2b_Error *error) {
   nextChar(ctx);
 
   char *start = curCharPos(ctx);
-  while (isalnum((int)curChar(ctx))) {
+  while (isalnum(transmuteU8(curChar(ctx)))) {
     nextChar(ctx);
   }
   char *end = curCharPos(ctx);
-  Slice s = slice(start, end);
-  char *cstr = sliceIntoCStr(s);
 
-  if (!strcmp(cstr, "begin")) {
+  switch (quesCmdFromStr(start, (size_t)(end - start))) {
+  case QUES_BEGIN:
     ctx->mode = PARSE_MULTI_LINE;
-  } else if (!strcmp(cstr, "end")) {
+    break;
+  case QUES_END:
     ctx->mode = PARSE_SINGLE_LINE;
     finishLine(ctx, error);
-  } else {
+    break;
+  case QUES_PARALLEL:
+    if (ctx->mode == PARSE_MULTI_LINE) {
+      pl2b_errPrintf(error, PL2B_ERR_PARALLEL, ctx->sourceInfo,
+                     NULL, "`?parallel` inside `?begin` block");
+    } else if (ctx->group != 0) {
+      pl2b_errPrintf(error, PL2B_ERR_PARALLEL, ctx->sourceInfo,
+                     NULL, "nested `?parallel` block");
+    } else {
+      ctx->group = ctx->sourceInfo.line;
+    }
+    break;
+  case QUES_JOIN:
+    if (ctx->mode == PARSE_MULTI_LINE) {
+      pl2b_errPrintf(error, PL2B_ERR_PARALLEL, ctx->sourceInfo,
+                     NULL, "`?join` inside `?begin` block");
+    } else if (ctx->group == 0) {
+      pl2b_errPrintf(error, PL2B_ERR_PARALLEL, ctx->sourceInfo,
+                     NULL, "`?join` without `?parallel`");
+    } else {
+      ctx->group = 0;
+    }
+    break;
+  default:
     pl2b_errPrintf(error, PL2B_ERR_UNKNOWN_QUES, ctx->sourceInfo,
-                   NULL, "unknown question mark operator: `%s`", cstr);
+                   NULL, "unknown question mark operator: `%.*s`",
+                   (int)(end - start), start);
+  }
+}
+
+static QuesCmd quesCmdFromStr(const char *str, size_t len) {
+  if (len == 5 && !strncmp(str, "begin", 5)) {
+    return QUES_BEGIN;
+  } else if (len == 3 && !strncmp(str, "end", 3)) {
+    return QUES_END;
+  } else if (len == 8 && !strncmp(str, "parallel", 8)) {
+    return QUES_PARALLEL;
+  } else if (len == 4 && !strncmp(str, "join", 4)) {
+    return QUES_JOIN;
+  } else {
+    return QUES_INVALID;
   }
 }
 
 static void parsePart(ParseContext *ctx, pl2b_Error *error) {
+  pl2b_SourceInfo partSourceInfo = ctx->sourceInfo;
   Slice slice;
   _Bool isString;
   if (curChar(ctx) == '"' || curChar(ctx) == '\'') {
@@ -406,23 +1288,36 @@ static void parsePart(ParseContext *ctx, pl2b_Error *error) {
   if (pl2b_isError(error)) {
     return;
   }
-
-  checkBufferSize(ctx, error);
-  if (pl2b_isError(error)) {
+  if ((size_t)(slice.end - slice.start) > PL2B_PART_MAX_LEN) {
+    pl2b_errPrintf(error, PL2B_ERR_GENERAL, partSourceInfo,
+                   NULL, "command part exceeds %u bytes",
+                   (unsigned)PL2B_PART_MAX_LEN);
     return;
   }
 
+  if (ctx->parseBufferUsage == ctx->parseBufferSize) {
+    growParseBuffer(ctx, error);
+    if (pl2b_isError(error)) {
+      return;
+    }
+  }
+
+  if (ctx->parseBufferUsage == 0) {
+    ctx->cmdSourceInfo = partSourceInfo;
+  }
   ctx->parseBuffer[ctx->parseBufferUsage++] =
     (ParsedPartCache) { slice, isString };
 }
 
 static Slice parseId(ParseContext *ctx, pl2b_Error *error) {
-  (void)error;
   char *start = curCharPos(ctx);
-  while (isIdChar(curChar(ctx))) {
-    nextChar(ctx);
-  }
+  skipTo(ctx, ctx->scanner->idRun(start));
   char *end = curCharPos(ctx);
+  if (start == end) {
+    pl2b_errPrintf(error, PL2B_ERR_GENERAL, ctx->sourceInfo,
+                   NULL, "unexpected character: `%c`", *start);
+    return nullSlice();
+  }
   return slice(start, end);
 }
 
@@ -431,15 +1326,13 @@ static Slice parseStr(ParseContext *ctx, pl2b_Error *error) {
   nextChar(ctx);
 
   char *start = curCharPos(ctx);
-  while (curChar(ctx) != '"'
-         && curChar(ctx) != '\''
-         && !isLineEnd(curChar(ctx))) {
-    if (curChar(ctx) == '\\') {
-      nextChar(ctx);
-      nextChar(ctx);
-    } else {
-      nextChar(ctx);
+  while (1) {
+    skipTo(ctx, ctx->scanner->strStop(curCharPos(ctx)));
+    if (curChar(ctx) != '\\') {
+      break;
     }
+    nextChar(ctx);
+    nextChar(ctx);
   }
   char *end = curCharPos(ctx);
   end = shrinkConv(start, end);
@@ -454,56 +1347,101 @@ static Slice parseStr(ParseContext *ctx, pl2b_Error *error) {
   return slice(start, end);
 }
 
-static void checkBufferSize(ParseContext *ctx, pl2b_Error *error) {
-  if (ctx->parseBufferSize <= ctx->parseBufferUsage + 1) {
-    pl2b_errPrintf(error, PL2B_ERR_UNCLOSED_BEGIN, ctx->sourceInfo,
+static void growParseBuffer(ParseContext *ctx, pl2b_Error *error) {
+  ParsedPartCache *newBuffer = NULL;
+  uint32_t newSize = ctx->parseBufferSize * 2;
+  if (newSize > ctx->parseBufferSize) {
+    newBuffer = (ParsedPartCache*)realloc(
+      ctx->parseBuffer, newSize * sizeof(ParsedPartCache)
+    );
+  }
+  if (newBuffer == NULL) {
+    pl2b_errPrintf(error, PL2B_ERR_PARSEBUF, ctx->sourceInfo,
                    NULL, "command parts exceed internal parsing buffer");
+    return;
   }
+  ctx->parseBuffer = newBuffer;
+  ctx->parseBufferSize = newSize;
 }
 
 static void finishLine(ParseContext *ctx, pl2b_Error *error) {
-  (void)error;
-
-  pl2b_SourceInfo sourceInfo = ctx->sourceInfo;
-  nextChar(ctx);
+  pl2b_SourceInfo sourceInfo = ctx->cmdSourceInfo;
   if (ctx->parseBufferUsage == 0) {
     return;
   }
+  if (ctx->denseCmds != NULL) {
+    if (!appendDenseCmd(ctx, sourceInfo, ctx->parseBuffer,
+                        ctx->parseBufferUsage)) {
+      pl2b_errPrintf(error, PL2B_ERR_MALLOC, sourceInfo, 0,
+                     "failed allocating pl2b_Cmd");
+    }
+    ctx->parseBufferUsage = 0;
+    return;
+  }
   if (ctx->listTail == NULL) {
     assert(ctx->program.commands == NULL);
     ctx->program.commands =
-      ctx->listTail = cmdFromSlices2(ctx->sourceInfo, ctx->parseBuffer);
+      ctx->listTail = cmdFromSlices3(ctx, sourceInfo, ctx->parseBuffer,
+                                     ctx->parseBufferUsage);
   } else {
-    ctx->listTail = cmdFromSlices5(ctx->listTail, NULL, NULL,
-                                   ctx->sourceInfo, ctx->parseBuffer);
+    ctx->listTail = cmdFromSlices6(ctx, ctx->listTail, NULL, NULL,
+                                   sourceInfo, ctx->parseBuffer,
+                                   ctx->parseBufferUsage);
   }
   if (ctx->listTail == NULL) {
     pl2b_errPrintf(error, PL2B_ERR_MALLOC, sourceInfo, 0,
                    "failed allocating pl2b_Cmd");
   }
-  memset(ctx->parseBuffer, 0, sizeof(Slice) * ctx->parseBufferSize);
   ctx->parseBufferUsage = 0;
 }
 
-static pl2b_Cmd *cmdFromSlices2(pl2b_SourceInfo sourceInfo,
-                                ParsedPartCache *parts) {
-  return cmdFromSlices5(NULL, NULL, NULL, sourceInfo, parts);
+static pl2b_Cmd *cmdFromSlices3(ParseContext *ctx,
+                                pl2b_SourceInfo sourceInfo,
+                                ParsedPartCache *parts,
+                                uint32_t partCount) {
+  return cmdFromSlices6(ctx, NULL, NULL, NULL, sourceInfo,
+                        parts, partCount);
 }
 
-static pl2b_Cmd *cmdFromSlices5(pl2b_Cmd *prev,
+/* If the context owns strings, they are copied right behind parts, so
+   the command is one self-contained block */
+static pl2b_Cmd *cmdFromSlices6(ParseContext *ctx,
+                                pl2b_Cmd *prev,
                                 pl2b_Cmd *next,
                                 void *extraData,
                                 pl2b_SourceInfo sourceInfo,
-                                ParsedPartCache *parts) {
-  uint16_t partCount = 0;
-  for (; !isNullSlice(parts[partCount].slice); ++partCount);
+                                ParsedPartCache *parts,
+                                uint32_t partCount) {
+  size_t strSize = 0;
+  if (ctx->ownStrings) {
+    for (uint32_t i = 0; i < partCount; i++) {
+      strSize += (size_t)(parts[i].slice.end - parts[i].slice.start) + 1;
+    }
+  }
 
-  pl2b_Cmd *ret = (pl2b_Cmd*)malloc(sizeof(pl2b_Cmd)
-                                    + partCount * sizeof(pl2b_CmdPart));
+  size_t cmdSize = sizeof(pl2b_Cmd)
+                   + partCount * sizeof(pl2b_CmdPart)
+                   + strSize;
+  pl2b_Cmd *ret = ctx->arena != NULL
+                  ? (pl2b_Cmd*)arenaAlloc(ctx->arena, cmdSize)
+                  : (pl2b_Cmd*)malloc(cmdSize);
   if (ret == NULL) {
     return NULL;
   }
 
+  ret->extraData = extraData;
+  ret->sourceInfo = sourceInfo;
+  ret->group = ctx->group;
+  ret->id = newCmdId();
+  ret->args = (pl2b_CmdPart*)(ret + 1);
+  if (!fillCmdParts(ctx, ret, parts, partCount,
+                    (char*)(ret->args + partCount))) {
+    if (ctx->arena == NULL) {
+      free(ret);
+    }
+    return NULL;
+  }
+
   ret->prev = prev;
   if (prev != NULL) {
     prev->next = ret;
@@ -512,42 +1450,128 @@ static pl2b_Cmd *cmdFromSlices5(pl2b_Cmd *prev,
   if (next != NULL) {
     next->prev = ret;
   }
-  ret->extraData = extraData;
-  ret->resolveCache = NULL;
-  ret->sourceInfo = sourceInfo;
-  ret->cmd = pl2b_cmdPart(sliceIntoCStr(parts[0].slice),
-                          parts[0].isString);
-  for (uint16_t i = 1; i < partCount; i++) {
-    ret->args[i - 1] = pl2b_cmdPart(sliceIntoCStr(parts[i].slice),
-                                    parts[i].isString);
-  }
-  ret->args[partCount - 1] = pl2b_cmdPart(NULL, 0);
   return ret;
 }
 
-static void skipWhitespace(ParseContext *ctx) {
-  while (1) {
-    switch (curChar(ctx)) {
-    case ' ': case '\t': case '\f': case '\v': case '\r':
-      nextChar(ctx);
-      break;
-    default:
-      return;
+/* Records only get their final `args`, `prev` and `next` once parsing
+   is done and they no longer move */
+static _Bool appendDenseCmd(ParseContext *ctx,
+                            pl2b_SourceInfo sourceInfo,
+                            ParsedPartCache *parts,
+                            uint32_t partCount) {
+  if (ctx->denseCmdUsage == ctx->denseCmdSize) {
+    pl2b_Cmd *newCmds = (pl2b_Cmd*)realloc(
+      ctx->denseCmds, ctx->denseCmdSize * 2 * sizeof(pl2b_Cmd)
+    );
+    if (newCmds == NULL) {
+      return 0;
     }
+    ctx->denseCmds = newCmds;
+    ctx->denseCmdSize *= 2;
   }
+  while (ctx->densePartSize - ctx->densePartUsage < partCount) {
+    pl2b_CmdPart *newParts = (pl2b_CmdPart*)realloc(
+      ctx->denseParts, ctx->densePartSize * 2 * sizeof(pl2b_CmdPart)
+    );
+    if (newParts == NULL) {
+      return 0;
+    }
+    ctx->denseParts = newParts;
+    ctx->densePartSize *= 2;
+  }
+
+  pl2b_Cmd *cmd = &ctx->denseCmds[ctx->denseCmdUsage];
+  cmd->extraData = NULL;
+  cmd->sourceInfo = sourceInfo;
+  cmd->group = ctx->group;
+  cmd->id = newCmdId();
+  cmd->args = ctx->denseParts + ctx->densePartUsage;
+  if (!fillCmdParts(ctx, cmd, parts, partCount, NULL)) {
+    return 0;
+  }
+  ctx->denseCmdUsage += 1;
+  ctx->densePartUsage += partCount;
+  return 1;
 }
 
-static void skipComment(ParseContext *ctx) {
-  assert(curChar(ctx) == '#');
-  nextChar(ctx);
+static void finishDenseCmds(ParseContext *ctx, pl2b_Error *error) {
+  size_t cmdCount = ctx->denseCmdUsage;
+  if (cmdCount == 0) {
+    return;
+  }
+  pl2b_Cmd *cmds = (pl2b_Cmd*)arenaAlloc(ctx->arena,
+                                         cmdCount * sizeof(pl2b_Cmd));
+  pl2b_CmdPart *parts = (pl2b_CmdPart*)arenaAlloc(
+    ctx->arena, ctx->densePartUsage * sizeof(pl2b_CmdPart)
+  );
+  if (cmds == NULL || parts == NULL) {
+    pl2b_errPrintf(error, PL2B_ERR_MALLOC, ctx->sourceInfo, 0,
+                   "failed allocating pl2b_Cmd");
+    return;
+  }
+  memcpy(cmds, ctx->denseCmds, cmdCount * sizeof(pl2b_Cmd));
+  memcpy(parts, ctx->denseParts,
+         ctx->densePartUsage * sizeof(pl2b_CmdPart));
 
-  while (!isLineEnd(curChar(ctx))) {
-    nextChar(ctx);
+  pl2b_CmdPart *args = parts;
+  for (size_t i = 0; i < cmdCount; i++) {
+    cmds[i].prev = i == 0 ? NULL : &cmds[i - 1];
+    cmds[i].next = i == cmdCount - 1 ? NULL : &cmds[i + 1];
+    cmds[i].args = args;
+    args += cmds[i].argc + 1;
   }
+  ctx->program.commands = cmds;
+  ctx->program.cmdCount = cmdCount;
+}
 
-  if (curChar(ctx) == '\n') {
-    nextChar(ctx);
+/* With a symbol table, command parts point to interned strings. Else
+   unless the context owns strings, command parts point into source
+   and get NUL-terminated in place. Otherwise strings are copied into
+   `strPool`. */
+static _Bool fillCmdParts(ParseContext *ctx,
+                          pl2b_Cmd *cmd,
+                          ParsedPartCache *parts,
+                          uint32_t partCount,
+                          char *strPool) {
+  cmd->argc = partCount - 1;
+  for (uint32_t i = 0; i < partCount; i++) {
+    char *str;
+    uint32_t symbol = PL2B_SYM_NONE;
+    size_t len = (size_t)(parts[i].slice.end - parts[i].slice.start);
+    if (ctx->symbols != NULL) {
+      str = internStr(ctx->symbols, parts[i].slice.start, len, &symbol);
+      if (str == NULL) {
+        return 0;
+      }
+    } else if (ctx->ownStrings) {
+      memcpy(strPool, parts[i].slice.start, len);
+      strPool[len] = '\0';
+      str = strPool;
+      strPool += len + 1;
+    } else {
+      str = sliceIntoCStr(parts[i].slice);
+    }
+    pl2b_CmdPart part = pl2b_cmdPart3(str, len, parts[i].isString);
+    part.symbol = symbol;
+    if (i == 0) {
+      cmd->cmd = part;
+    } else {
+      cmd->args[i - 1] = part;
+    }
   }
+  cmd->args[partCount - 1] = pl2b_cmdPart(NULL, 0);
+  return 1;
+}
+
+static void skipWhitespace(ParseContext *ctx) {
+  skipTo(ctx, ctx->scanner->whitespaceRun(curCharPos(ctx)));
+}
+
+static void skipComment(ParseContext *ctx) {
+  assert(curChar(ctx) == '#');
+  nextChar(ctx);
+
+  skipTo(ctx, ctx->scanner->lineEnd(curCharPos(ctx)));
 }
 
 static char curChar(ParseContext *ctx) {
@@ -569,6 +1593,12 @@ static void nextChar(ParseContext *ctx) {
   }
 }
 
+/* Scanner runs never contain a newline, so skipping over one does not
+   need to update line numbers */
+static void skipTo(ParseContext *ctx, const char *pos) {
+  ctx->srcIdx = (size_t)(pos - ctx->src);
+}
+
 static _Bool isIdChar(char ch) {
   unsigned char uch = transmuteU8(ch);
   if (uch >= 128) {
@@ -589,12 +1619,13 @@ static _Bool isIdChar(char ch) {
   }
 }
 
-static _Bool isLineEnd(char ch) {
-  return ch == '\0' || ch == '\n';
-}
-
 static char *shrinkConv(char *start, char *end) {
-  char *iter1 = start, *iter2 = start;
+  char *iter1 = (char*)memchr(start, '\\', (size_t)(end - start));
+  if (iter1 == NULL) {
+    return end;
+  }
+
+  char *iter2 = iter1;
   while (iter1 != end) {
     if (iter1[0] == '\\') {
       switch (iter1[1]) {
@@ -610,457 +1641,4356 @@ static char *shrinkConv(char *start, char *end) {
         *iter2++ = *iter1++;
       }
     } else {
-      *iter2++ = *iter1++;
+      char *escape = (char*)memchr(iter1, '\\', (size_t)(end - iter1));
+      size_t runLen = (size_t)((escape ? escape : end) - iter1);
+      memmove(iter2, iter1, runLen);
+      iter1 += runLen;
+      iter2 += runLen;
     }
   }
   return iter2;
 }
 
-/*** -------------------- Semantic-ver parsing  -------------------- ***/
+/*** ---------------- Implementation of lazy program --------------- ***/
 
-static const char *parseUint16(const char *src,
-                               uint16_t *output,
-                               pl2b_Error *error);
+/* A lazy program keeps its parse context until source is exhausted. A
+   syntax error met while parsing ahead is kept pending, and the last
+   parsed command gets the program's own `errorCmd` as its `next`. The
+   error is only reported once execution reaches that command, so that a
+   stub ending the run by returning NULL right before the error still
+   succeeds. */
 
-static void parseSemVerPostfix(const char *src,
-                               char *output,
-                               pl2b_Error *error);
+#define LAZY_ERROR_BUFFER_SIZE 512
 
-pl2b_SemVer pl2b_zeroVersion(void) {
-  pl2b_SemVer ret;
-  ret.major = 0;
-  ret.minor = 0;
-  ret.patch = 0;
-  memset(ret.postfix, 0, PL2B_SEMVER_POSTFIX_LEN);
-  ret.exact = 0;
+struct st_lazy_program {
+  ParseContext *ctx;
+  pl2b_Error *pendingError;
+  /* stands for commands that failed to parse, never runs */
+  pl2b_Cmd errorCmd;
+  pl2b_CmdPart errorArgs[1];
+};
+
+static void lazyParseNext(pl2b_Program *program, pl2b_Cmd *cmd);
+static void takeLazyError(pl2b_Program *program, pl2b_Error *error);
+
+static pl2b_Program startLazyProgram(ParseContext *ctx, pl2b_Error *error) {
+  parseNextCmd(ctx, error);
+  pl2b_Program ret = ctx->program;
+  if (pl2b_isError(error) || curChar(ctx) == '\0') {
+    dropParseContext(ctx);
+    return ret;
+  }
+
+  LazyProgram *lazy = (LazyProgram*)malloc(sizeof(LazyProgram));
+  pl2b_Error *pendingError = pl2b_errorBuffer(LAZY_ERROR_BUFFER_SIZE);
+  if (lazy == NULL || pendingError == NULL) {
+    free(lazy);
+    if (pendingError != NULL) {
+      pl2b_dropError(pendingError);
+    }
+    dropParseContext(ctx);
+    pl2b_errPrintf(error, PL2B_ERR_MALLOC, pl2b_sourceInfo(NULL, 0),
+                   NULL, "allocation failure");
+    return ret;
+  }
+  lazy->ctx = ctx;
+  lazy->pendingError = pendingError;
+  lazy->errorArgs[0] = pl2b_cmdPart(NULL, 0);
+  lazy->errorCmd.prev = NULL;
+  lazy->errorCmd.next = NULL;
+  lazy->errorCmd.extraData = NULL;
+  lazy->errorCmd.sourceInfo = pl2b_sourceInfo("<lazy-error>", 0);
+  lazy->errorCmd.argc = 0;
+  lazy->errorCmd.group = 0;
+  lazy->errorCmd.id = newCmdId();
+  lazy->errorCmd.cmd = pl2b_cmdPart3((char*)"", 0, 0);
+  lazy->errorCmd.args = lazy->errorArgs;
+  ret.lazy = lazy;
   return ret;
 }
 
-_Bool pl2b_isZeroVersion(pl2b_SemVer ver) {
-  return ver.major == 0
-         && ver.minor == 0
-         && ver.patch == 0
-         && ver.postfix[0] == 0
-         && ver.exact == 0;
+pl2b_Cmd *pl2b_nextCmd(pl2b_Program *program,
+                       pl2b_Cmd *cmd,
+                       pl2b_Error *error) {
+  if (cmd->next == NULL && program->lazy != NULL) {
+    lazyParseNext(program, cmd);
+  }
+  if (isLazyError(program, cmd->next)) {
+    takeLazyError(program, error);
+    return NULL;
+  }
+  return cmd->next;
 }
 
-_Bool pl2b_isAlpha(pl2b_SemVer ver) {
-  return ver.postfix[0] != '\0';
-}
+static void lazyParseNext(pl2b_Program *program, pl2b_Cmd *cmd) {
+  LazyProgram *lazy = (LazyProgram*)program->lazy;
+  if (lazy == NULL
+      || lazy->ctx == NULL
+      || cmd != lazy->ctx->listTail
+      || pl2b_isError(lazy->pendingError)) {
+    return;
+  }
 
-_Bool pl2b_isStable(pl2b_SemVer ver) {
-  return !pl2b_isAlpha(ver) && ver.major != 0;
+  parseNextCmd(lazy->ctx, lazy->pendingError);
+  if (pl2b_isError(lazy->pendingError)) {
+    cmd->next = &lazy->errorCmd;
+    lazy->errorCmd.prev = cmd;
+  }
+  if (curChar(lazy->ctx) == '\0' || pl2b_isError(lazy->pendingError)) {
+    dropParseContext(lazy->ctx);
+    lazy->ctx = NULL;
+  }
 }
 
-pl2b_SemVer pl2b_parseSemVer(const char *src, pl2b_Error *error) {
-  pl2b_SemVer ret = pl2b_zeroVersion();
-  if (src[0] == '^') {
-    ret.exact = 1;
-    src++;
+static void takeLazyError(pl2b_Program *program, pl2b_Error *error) {
+  LazyProgram *lazy = (LazyProgram*)program->lazy;
+  if (lazy != NULL && pl2b_isError(lazy->pendingError)) {
+    pl2b_errPrintf(error, lazy->pendingError->errorCode,
+                   lazy->pendingError->sourceInfo, NULL,
+                   "%s", lazy->pendingError->reason);
   }
+}
 
-  src = parseUint16(src, &ret.major, error);
-  if (pl2b_isError(error)) {
-    pl2b_errPrintf(error, PL2B_ERR_SEMVER_PARSE,
-                   pl2b_sourceInfo(NULL, 0), NULL,
-                   "missing major version");
-    goto done;
-  } else if (src[0] == '\0') {
-    goto done;
-  } else if (src[0] == '-') {
-    goto parse_postfix;
-  } else if (src[0] != '.') {
-    pl2b_errPrintf(error, PL2B_ERR_SEMVER_PARSE,
-                   pl2b_sourceInfo(NULL, 0), NULL,
-                   "expected `.`, got `%c`", src[0]);
-    goto done;
+static _Bool isLazyError(const pl2b_Program *program, const pl2b_Cmd *cmd) {
+  return program->lazy != NULL
+         && cmd == &((const LazyProgram*)program->lazy)->errorCmd;
+}
+
+static void dropLazyProgram(LazyProgram *lazy) {
+  if (lazy->ctx != NULL) {
+    dropParseContext(lazy->ctx);
   }
+  pl2b_dropError(lazy->pendingError);
+  free(lazy);
+}
 
-  src++;
-  src = parseUint16(src, &ret.minor, error);
-  if (pl2b_isError(error)) {
-    pl2b_errPrintf(error, PL2B_ERR_SEMVER_PARSE,
-                   pl2b_sourceInfo(NULL, 0),
-                   NULL, "missing minor version");
-    goto done;
-  } else if (src[0] == '\0') {
-    goto done;
-  } else if (src[0] == '-') {
-    goto parse_postfix;
-  } else if (src[0] != '.') {
-    pl2b_errPrintf(error, PL2B_ERR_SEMVER_PARSE,
-                   pl2b_sourceInfo(NULL, 0), NULL,
-                   "expected `.`, got `%c`", src[0]);
-    goto done;
+/*** -------------- Implementation of pl2b_ParseStream ------------- ***/
+
+/* Stream input is cut into units, each ending with a newline that
+   closes a command outside of any `?begin` block. A unit is parsed as
+   a whole with the ordinary parser once its end has been fed, and the
+   splitter below only tracks enough lexical state to find such ends. */
+
+typedef enum e_split_state {
+  SPLIT_LINE_START = 0,
+  SPLIT_QUES       = 1,
+  SPLIT_NONE       = 2,
+  SPLIT_ID         = 3,
+  SPLIT_STR        = 4,
+  SPLIT_STR_ESCAPE = 5,
+  SPLIT_COMMENT    = 6
+} SplitState;
+
+#define STREAM_QUES_WORD_LEN 8
+
+struct st_pl2b_parse_stream {
+  ParseContext *ctx;
+  pl2b_StreamCmdStub *onCmd;
+  void *userData;
+
+  char *buffer;
+  size_t bufferSize;
+  size_t bufferCap;
+  size_t scanIdx;
+  uint32_t line;
+  _Bool ended;
+  _Bool failed;
+
+  SplitState state;
+  ParseMode mode;
+  char quesWord[STREAM_QUES_WORD_LEN];
+  size_t quesWordLen;
+};
+
+static _Bool streamReserve(pl2b_ParseStream *stream, size_t size);
+static size_t streamSplit(pl2b_ParseStream *stream);
+static _Bool splitChar(pl2b_ParseStream *stream, char ch);
+static void streamParseUnit(pl2b_ParseStream *stream,
+                            char *unit,
+                            size_t unitSize,
+                            pl2b_Error *error);
+
+pl2b_ParseStream *pl2b_createParseStream(uint16_t parseBufferSize,
+                                         pl2b_StreamCmdStub *onCmd,
+                                         void *userData) {
+  pl2b_ParseStream *ret =
+    (pl2b_ParseStream*)malloc(sizeof(pl2b_ParseStream));
+  if (ret == NULL) {
+    return NULL;
   }
 
-  src++;
-  src = parseUint16(src, &ret.patch, error);
-  if (pl2b_isError(error)) {
-    pl2b_errPrintf(error, PL2B_ERR_SEMVER_PARSE,
-                   pl2b_sourceInfo(NULL, 0), NULL,
-                   "missing patch version");
-    goto done;
-  } else if (src[0] == '\0') {
-    goto done;
-  } else if (src[0] != '-') {
-    pl2b_errPrintf(error, PL2B_ERR_SEMVER_PARSE,
-                   pl2b_sourceInfo(NULL, 0), NULL,
-                   "unterminated semver, "
-                   "expected `-` or `\\0`, got `%c`",
-                   src[0]);
-    goto done;
+  ret->ctx = createParseContext(NULL, parseBufferSize, 0);
+  if (ret->ctx == NULL) {
+    free(ret);
+    return NULL;
   }
+  ret->ctx->ownStrings = 1;
+  ret->ctx->openEnded = 1;
+  ret->onCmd = onCmd;
+  ret->userData = userData;
 
-parse_postfix:
-  parseSemVerPostfix(src, ret.postfix, error);
+  ret->buffer = NULL;
+  ret->bufferSize = 0;
+  ret->bufferCap = 0;
+  ret->scanIdx = 0;
+  ret->line = 1;
+  ret->ended = 0;
+  ret->failed = 0;
 
-done:
+  ret->state = SPLIT_LINE_START;
+  ret->mode = PARSE_SINGLE_LINE;
+  ret->quesWordLen = 0;
+  /* a stream is one parse, from creation to its end or first error */
+  PROBE2(parse_start, ret, (uint16_t)0);
   return ret;
 }
 
-_Bool pl2b_isCompatible(pl2b_SemVer expected, pl2b_SemVer actual) {
-  if (strncmp(expected.postfix,
-              actual.postfix,
-              PL2B_SEMVER_POSTFIX_LEN) != 0) {
-    return 0;
+void pl2b_feedParseStream(pl2b_ParseStream *stream,
+                          const char *chunk,
+                          size_t chunkSize,
+                          pl2b_Error *error) {
+  if (stream->failed || stream->ended) {
+    return;
   }
-  if (expected.exact) {
-    return expected.major == actual.major
-           && expected.minor == actual.minor
-           && expected.patch == actual.patch;
-  } else if (expected.major == actual.major) {
-    return (expected.minor == actual.minor
-              && expected.patch < actual.patch)
-            || (expected.minor < actual.minor);
-  } else {
-    return 0;
+
+  if (!streamReserve(stream, stream->bufferSize + chunkSize + 1)) {
+    stream->failed = 1;
+    pl2b_errPrintf(error, PL2B_ERR_MALLOC,
+                   pl2b_sourceInfo("<unknown-file>", stream->line),
+                   NULL, "parse stream: cannot grow input buffer");
+    PROBE2(parse_done, stream, error->errorCode);
+    return;
   }
-}
+  memcpy(stream->buffer + stream->bufferSize, chunk, chunkSize);
+  stream->bufferSize += chunkSize;
 
-pl2b_CmpResult pl2b_semverCmp(pl2b_SemVer ver1, pl2b_SemVer ver2) {
-  if (!strncmp(ver1.postfix, ver2.postfix, PL2B_SEMVER_POSTFIX_LEN)) {
-    return PL2B_CMP_NONE;
+  size_t unitStart = 0;
+  while (1) {
+    size_t unitEnd = streamSplit(stream);
+    if (unitEnd == 0) {
+      break;
+    }
+    streamParseUnit(stream,
+                    stream->buffer + unitStart,
+                    unitEnd - unitStart,
+                    error);
+    if (stream->failed) {
+      PROBE2(parse_done, stream, error->errorCode);
+      return;
+    }
+    unitStart = unitEnd;
   }
 
-  if (ver1.major < ver2.major) {
-    return PL2B_CMP_LESS;
-  } else if (ver1.major > ver2.major) {
-    return PL2B_CMP_GREATER;
-  } else if (ver1.minor < ver2.minor) {
-    return PL2B_CMP_LESS;
-  } else if (ver1.minor > ver2.minor) {
-    return PL2B_CMP_GREATER;
-  } else if (ver1.patch < ver2.patch) {
-    return PL2B_CMP_LESS;
-  } else if (ver1.patch > ver2.patch) {
-    return PL2B_CMP_GREATER;
-  } else {
-    return PL2B_CMP_EQ;
+  if (unitStart != 0) {
+    memmove(stream->buffer,
+            stream->buffer + unitStart,
+            stream->bufferSize - unitStart);
+    stream->bufferSize -= unitStart;
+    stream->scanIdx -= unitStart;
   }
 }
 
-void pl2b_semverToString(pl2b_SemVer ver, char *buffer) {
-  if (ver.postfix[0]) {
-    sprintf(buffer, "%s%u.%u.%u-%s",
-            ver.exact ? "^" : "",
-            ver.major,
-            ver.minor,
-            ver.patch,
-            ver.postfix);
-  } else {
-    sprintf(buffer, "%s%u.%u.%u",
-            ver.exact ? "^" : "",
-            ver.major,
-            ver.minor,
-            ver.patch);
+void pl2b_finishParseStream(pl2b_ParseStream *stream, pl2b_Error *error) {
+  if (stream->failed) {
+    return;
+  }
+
+  if (stream->ended) {
+    stream->bufferSize = stream->scanIdx;
+  }
+  stream->ctx->openEnded = 0;
+  if (stream->bufferSize != 0
+      || stream->mode == PARSE_MULTI_LINE
+      || stream->ctx->group != 0) {
+    if (!streamReserve(stream, stream->bufferSize + 1)) {
+      stream->failed = 1;
+      pl2b_errPrintf(error, PL2B_ERR_MALLOC,
+                     pl2b_sourceInfo("<unknown-file>", stream->line),
+                     NULL, "parse stream: cannot grow input buffer");
+      PROBE2(parse_done, stream, error->errorCode);
+      return;
+    }
+    streamParseUnit(stream, stream->buffer, stream->bufferSize, error);
   }
+  stream->bufferSize = 0;
+  stream->scanIdx = 0;
+  stream->ended = 1;
+  PROBE2(parse_done, stream, error->errorCode);
 }
 
-static const char *parseUint16(const char *src,
-                               uint16_t *output,
-                               pl2b_Error *error) {
-  if (!isdigit((int)src[0])) {
-    pl2b_errPrintf(error, PL2B_ERR_SEMVER_PARSE,
-                   pl2b_sourceInfo(NULL, 0),
-                   NULL, "expected numeric version");
-    return NULL;
+void pl2b_dropParseStream(pl2b_ParseStream *stream) {
+  dropParseContext(stream->ctx);
+  free(stream->buffer);
+  free(stream);
+}
+
+static _Bool streamReserve(pl2b_ParseStream *stream, size_t size) {
+  if (size <= stream->bufferCap) {
+    return 1;
   }
-  *output = 0;
-  while (isdigit((int)src[0])) {
-    *output *= 10;
-    *output += src[0] - '0';
-    ++src;
+
+  size_t newCap = stream->bufferCap == 0 ? 4096 : stream->bufferCap;
+  while (newCap < size) {
+    newCap *= 2;
   }
-  return src;
+  char *newBuffer = (char*)realloc(stream->buffer, newCap);
+  if (newBuffer == NULL) {
+    return 0;
+  }
+  stream->buffer = newBuffer;
+  stream->bufferCap = newCap;
+  return 1;
 }
 
-static void parseSemVerPostfix(const char *src,
-                               char *output,
-                               pl2b_Error *error) {
-  assert(src[0] == '-');
-  ++src;
-  if (src[0] == '\0') {
-    pl2b_errPrintf(error, PL2B_ERR_SEMVER_PARSE,
-                   pl2b_sourceInfo(NULL, 0), NULL,
-                   "empty semver postfix");
-    return;
+/* Scans unclassified input and returns the offset right behind the next
+   unit, or 0 if no complete unit is buffered yet. */
+static size_t streamSplit(pl2b_ParseStream *stream) {
+  while (stream->scanIdx < stream->bufferSize) {
+    char ch = stream->buffer[stream->scanIdx];
+    if (ch == '\0') {
+      /* as with pl2b_parse, NUL terminates the input */
+      stream->ended = 1;
+      return 0;
+    }
+    stream->scanIdx += 1;
+    if (splitChar(stream, ch)) {
+      return stream->scanIdx;
+    }
   }
-  for (size_t i = 0; i < PL2B_SEMVER_POSTFIX_LEN - 1; i++) {
-    if (!(*output++ = *src++)) {
-      return;
+  return 0;
+}
+
+/* Returns whether `ch` closes a unit */
+static _Bool splitChar(pl2b_ParseStream *stream, char ch) {
+  switch (stream->state) {
+  case SPLIT_LINE_START:
+    if (ch == '?') {
+      stream->state = SPLIT_QUES;
+      stream->quesWordLen = 0;
+      return 0;
+    }
+    break;
+  case SPLIT_QUES:
+    if (isalnum(transmuteU8(ch))) {
+      if (stream->quesWordLen < STREAM_QUES_WORD_LEN) {
+        stream->quesWord[stream->quesWordLen] = ch;
+      }
+      stream->quesWordLen += 1;
+      return 0;
+    }
+    if (stream->quesWordLen <= STREAM_QUES_WORD_LEN) {
+      switch (quesCmdFromStr(stream->quesWord, stream->quesWordLen)) {
+      case QUES_BEGIN:
+        stream->mode = PARSE_MULTI_LINE;
+        break;
+      case QUES_END:
+        stream->mode = PARSE_SINGLE_LINE;
+        break;
+      default:
+        break;
+      }
+    }
+    break;
+  case SPLIT_STR:
+    if (ch == '\\') {
+      stream->state = SPLIT_STR_ESCAPE;
+      return 0;
+    } else if (ch == '"' || ch == '\'') {
+      stream->state = SPLIT_NONE;
+      return 0;
+    } else if (ch != '\n') {
+      return 0;
+    }
+    break;
+  case SPLIT_STR_ESCAPE:
+    stream->state = SPLIT_STR;
+    return 0;
+  case SPLIT_COMMENT:
+    if (ch != '\n') {
+      return 0;
     }
+    break;
+  default:
+    break;
   }
-  if (src[0] != '\0') {
-    pl2b_errPrintf(error, PL2B_ERR_SEMVER_PARSE,
-                   pl2b_sourceInfo(NULL, 0), NULL,
-                   "semver postfix too long");
-    return;
+
+  switch (ch) {
+  case '\n':
+    stream->state = SPLIT_LINE_START;
+    return stream->mode == PARSE_SINGLE_LINE;
+  case ' ': case '\t': case '\f': case '\v': case '\r':
+    stream->state = SPLIT_NONE;
+    break;
+  case '#':
+    stream->state = SPLIT_COMMENT;
+    break;
+  case '"':
+    stream->state = SPLIT_STR;
+    break;
+  case '\'':
+    /* a quote inside an identifier does not start a string */
+    if (stream->state != SPLIT_ID) {
+      stream->state = SPLIT_STR;
+    }
+    break;
+  default:
+    stream->state = isIdChar(ch) ? SPLIT_ID : SPLIT_NONE;
   }
+  return 0;
 }
 
-/*** ----------------------------- Run ----------------------------- ***/
+static void streamParseUnit(pl2b_ParseStream *stream,
+                            char *unit,
+                            size_t unitSize,
+                            pl2b_Error *error) {
+  ParseContext *ctx = stream->ctx;
+  char savedChar = unit[unitSize];
+  unit[unitSize] = '\0';
 
-typedef struct st_run_context {
-  pl2b_Program *program;
-  pl2b_Cmd *curCmd;
-  void *userContext;
+  pl2b_initProgram(&ctx->program);
+  ctx->listTail = NULL;
+  ctx->src = unit;
+  ctx->srcIdx = 0;
+  ctx->mode = PARSE_SINGLE_LINE;
+  ctx->sourceInfo.line = stream->line;
+  parseAll(ctx, error);
 
-  void *libHandle;
-  pl2b_Language *language;
-} RunContext;
+  unit[unitSize] = savedChar;
+  stream->line = ctx->sourceInfo.line;
+  if (pl2b_isError(error)) {
+    stream->failed = 1;
+  }
 
-static RunContext *createRunContext(pl2b_Program *program);
-static void destroyRunContext(RunContext *context);
-static _Bool cmdHandler(RunContext *context,
-                        pl2b_Cmd *cmd,
-                        pl2b_Error *error);
-static _Bool checkNextCmdRet(RunContext *context,
-                             pl2b_Cmd *nextCmd,
-                             pl2b_Error *error);
-static _Bool loadLanguage(RunContext *context,
-                          pl2b_Cmd *cmd,
-                          pl2b_Error *error);
+  pl2b_Cmd *iter = ctx->program.commands;
+  while (iter != NULL) {
+    pl2b_Cmd *next = iter->next;
+    iter->prev = NULL;
+    iter->next = NULL;
+    stream->onCmd(stream->userData, iter);
+    iter = next;
+  }
+}
 
-void pl2b_run(pl2b_Program *program, pl2b_Error *error) {
-  RunContext *context = createRunContext(program);
-  if (context == NULL) {
+/*** ------------ Implementation of pl2b_parseParallel ------------- ***/
+
+/* Source is cut into chunks right behind newlines, and each chunk is
+   parsed on its own thread from a private copy, assuming it starts a
+   fresh line outside of any `?begin` or `?parallel` block. Chunks are
+   then accepted in order: a chunk starts where assumed iff its
+   predecessor parsed without error. A predecessor failing only because
+   it ran into the end of its chunk (inside a `?begin` or `?parallel`
+   block, or a string with escaped newline) gets merged with the chunk
+   and parsed again serially. Any other error is exactly what the serial
+   parser would have reported first. Chunks are at least 64 KiB, unless
+   the environment variable `PL2B_PARSE_CHUNK_MIN` sets another minimum,
+   so that tests reach the merge with small sources. */
+
+#define PARALLEL_MIN_CHUNK_SIZE ((size_t)64 * 1024)
+
+typedef struct st_parse_chunk {
+  const char *start;
+  size_t size;
+  uint16_t parseBufferSize;
+  uint16_t errorBufferSize;
+  uint32_t firstLine;
+  size_t newlineCount;
+
+  pl2b_Program program;
+  pl2b_Cmd *listTail;
+  pl2b_Error *error;
+  _Bool hitEnd;
+} ParseChunk;
+
+static size_t minChunkSize(void);
+static void *countChunkNewlines(void *chunk);
+static void *parseChunk(void *chunk);
+static void runChunkWorkers(ParseChunk *chunks,
+                            size_t chunkCount,
+                            void *(*worker)(void *));
+static void dropChunkResult(ParseChunk *chunk);
+
+pl2b_Program pl2b_parseParallel(const char *source,
+                                uint16_t parseBufferSize,
+                                uint16_t threadCount,
+                                pl2b_Error *error) {
+  PROBE2(parse_start, source, (uint16_t)0);
+  size_t sourceSize = strlen(source);
+  if (threadCount == 0) {
+    long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+    threadCount = cpuCount > 0 ? (uint16_t)cpuCount : 1;
+  }
+  size_t chunkCount = sourceSize / minChunkSize();
+  if (chunkCount > threadCount) {
+    chunkCount = threadCount;
+  } else if (chunkCount == 0) {
+    chunkCount = 1;
+  }
+
+  ParseChunk *chunks = (ParseChunk*)malloc(chunkCount * sizeof(ParseChunk));
+  if (chunks == NULL) {
     pl2b_errPrintf(error, PL2B_ERR_MALLOC, pl2b_sourceInfo(NULL, 0),
-                   NULL, "run: cannot allocate memory for run context");
-    return;
+                   NULL, "allocation failure");
+    PROBE2(parse_done, source, error->errorCode);
+    return (pl2b_Program) { NULL, NULL, NULL, 0, NULL };
   }
 
-  while (cmdHandler(context, context->curCmd, error)) {
-    if (pl2b_isError(error)) {
+  size_t chunkStart = 0;
+  for (size_t i = 0; i < chunkCount; i++) {
+    size_t chunkEnd = sourceSize;
+    if (i != chunkCount - 1) {
+      size_t nominalEnd = sourceSize / chunkCount * (i + 1);
+      if (nominalEnd < chunkStart) {
+        nominalEnd = chunkStart;
+      }
+      const char *newline =
+        (const char*)memchr(source + nominalEnd, '\n',
+                            sourceSize - nominalEnd);
+      chunkEnd = newline != NULL ? (size_t)(newline - source) + 1
+                                 : sourceSize;
+    }
+    chunks[i].start = source + chunkStart;
+    chunks[i].size = chunkEnd - chunkStart;
+    chunks[i].parseBufferSize = parseBufferSize;
+    chunks[i].errorBufferSize = error->errorBufferSize;
+    chunkStart = chunkEnd;
+  }
+
+  runChunkWorkers(chunks, chunkCount, countChunkNewlines);
+  uint32_t line = 1;
+  for (size_t i = 0; i < chunkCount; i++) {
+    chunks[i].firstLine = line;
+    line = (uint32_t)(line + chunks[i].newlineCount);
+  }
+  runChunkWorkers(chunks, chunkCount, parseChunk);
+
+  pl2b_Program ret = { NULL, NULL, NULL, 0, NULL };
+  pl2b_Cmd *listTail = NULL;
+  size_t i = 0;
+  while (i < chunkCount) {
+    ParseChunk *chunk = &chunks[i];
+    if (chunk->error == NULL) {
+      pl2b_errPrintf(error, PL2B_ERR_MALLOC, pl2b_sourceInfo(NULL, 0),
+                     NULL, "allocation failure");
+      break;
+    }
+
+    if (pl2b_isError(chunk->error)
+        && chunk->hitEnd
+        && i != chunkCount - 1) {
+      ParseChunk *nextChunk = &chunks[i + 1];
+      dropChunkResult(chunk);
+      dropChunkResult(nextChunk);
+      nextChunk->start = chunk->start;
+      nextChunk->size += chunk->size;
+      nextChunk->firstLine = chunk->firstLine;
+      parseChunk(nextChunk);
+      i++;
+      continue;
+    }
+
+    if (chunk->program.commands != NULL) {
+      if (listTail == NULL) {
+        ret.commands = chunk->program.commands;
+      } else {
+        listTail->next = chunk->program.commands;
+        chunk->program.commands->prev = listTail;
+      }
+      listTail = chunk->listTail;
+    }
+    if (ret.arena == NULL) {
+      ret.arena = chunk->program.arena;
+    } else if (chunk->program.arena != NULL) {
+      arenaAdopt((Arena*)ret.arena, (Arena*)chunk->program.arena);
+    }
+    chunk->program.arena = NULL;
+
+    if (pl2b_isError(chunk->error)) {
+      pl2b_errPrintf(error, chunk->error->errorCode,
+                     chunk->error->sourceInfo, NULL,
+                     "%s", chunk->error->reason);
       break;
     }
+    i++;
   }
 
-  destroyRunContext(context);
+  for (size_t j = 0; j < chunkCount; j++) {
+    dropChunkResult(&chunks[j]);
+  }
+  free(chunks);
+  PROBE2(parse_done, source, error->errorCode);
+  return ret;
 }
 
-static RunContext *createRunContext(pl2b_Program *program) {
-  RunContext *context = (RunContext*)malloc(sizeof(RunContext));
-  if (context == NULL) {
-    return NULL;
+static size_t minChunkSize(void) {
+  const char *forced = getenv("PL2B_PARSE_CHUNK_MIN");
+  if (forced != NULL && *forced != '\0') {
+    long size = strtol(forced, NULL, 10);
+    if (size > 0) {
+      return (size_t)size;
+    }
   }
+  return PARALLEL_MIN_CHUNK_SIZE;
+}
 
-  context->program = program;
-  context->curCmd = program->commands;
-  context->userContext = NULL;
-  context->libHandle = NULL;
-  context->language = NULL;
-  return context;
+static void *countChunkNewlines(void *chunk) {
+  ParseChunk *self = (ParseChunk*)chunk;
+  self->newlineCount = getScanner()->countNewlines(self->start,
+                                                   self->start + self->size);
+  self->program = (pl2b_Program) { NULL, NULL, NULL, 0, NULL };
+  self->listTail = NULL;
+  self->error = NULL;
+  self->hitEnd = 0;
+  return NULL;
 }
 
-static void destroyRunContext(RunContext *context) {
-  if (context->libHandle != NULL) {
-    if (context->language != NULL) {
-      if (context->language->atExit != NULL) {
-        context->language->atExit(context->userContext);
-      }
-      if (context->language->cmdCleanup != NULL) {
-        for (pl2b_Cmd *cmd = context->program->commands;
-             cmd != NULL;
-             cmd = cmd->next) {
-          context->language->cmdCleanup(cmd->extraData);
-        }
-      }
-      context->language = NULL;
+static void *parseChunk(void *chunk) {
+  ParseChunk *self = (ParseChunk*)chunk;
+  self->error = pl2b_errorBuffer(self->errorBufferSize);
+  ParseContext *ctx = createParseContext(NULL, self->parseBufferSize, 1);
+  char *copy = ctx != NULL ? (char*)arenaAlloc(ctx->arena, self->size + 1)
+                           : NULL;
+  if (self->error == NULL || copy == NULL) {
+    if (ctx != NULL) {
+      dropArena(ctx->arena);
+      dropParseContext(ctx);
     }
-    if (dlclose(context->libHandle) != 0) {
-      fprintf(stderr, "[int/e] error invoking dlclose: %s\n", dlerror());
+    if (self->error != NULL) {
+      pl2b_dropError(self->error);
+      self->error = NULL;
     }
+    return NULL;
   }
-  free(context);
+  memcpy(copy, self->start, self->size);
+  copy[self->size] = '\0';
+
+  ctx->src = copy;
+  ctx->sourceInfo.line = self->firstLine;
+  parseAll(ctx, self->error);
+
+  self->program = ctx->program;
+  self->listTail = ctx->listTail;
+  self->hitEnd = ctx->srcIdx == self->size;
+  dropParseContext(ctx);
+  return NULL;
 }
 
-static _Bool cmdHandler(RunContext *context,
-                        pl2b_Cmd *cmd,
-                        pl2b_Error *error) {
-  if (cmd == NULL) {
-    return 0;
+static void runChunkWorkers(ParseChunk *chunks,
+                            size_t chunkCount,
+                            void *(*worker)(void *)) {
+  pthread_t *threads = (pthread_t*)malloc(chunkCount * sizeof(pthread_t));
+  _Bool *started = (_Bool*)calloc(chunkCount, sizeof(_Bool));
+  for (size_t i = 1; threads != NULL && started != NULL
+                     && i < chunkCount; i++) {
+    started[i] = pthread_create(&threads[i], NULL, worker, &chunks[i]) == 0;
+  }
+  /* the calling thread takes the first chunk, and any chunk a thread
+     could not be started for */
+  for (size_t i = 0; i < chunkCount; i++) {
+    if (i == 0 || started == NULL || !started[i]) {
+      worker(&chunks[i]);
+    }
   }
+  for (size_t i = 1; started != NULL && i < chunkCount; i++) {
+    if (started[i]) {
+      pthread_join(threads[i], NULL);
+    }
+  }
+  free(threads);
+  free(started);
+}
 
-  if (!strcmp(cmd->cmd.str, "language")) {
-    return loadLanguage(context, cmd, error);
-  } else if (!strcmp(cmd->cmd.str, "abort")) {
-    return 0;
+static void dropChunkResult(ParseChunk *chunk) {
+  if (chunk->program.arena != NULL) {
+    dropArena((Arena*)chunk->program.arena);
   }
+  chunk->program = (pl2b_Program) { NULL, NULL, NULL, 0, NULL };
+  chunk->listTail = NULL;
+  if (chunk->error != NULL) {
+    pl2b_dropError(chunk->error);
+    chunk->error = NULL;
+  }
+}
 
-  if (context->language == NULL) {
-    pl2b_errPrintf(error, PL2B_ERR_NO_LANG, cmd->sourceInfo, NULL,
-                   "no language loaded to execute user command");
-    return 1;
+/*** ----------------- Implementation of program image ---------------- ***/
+
+/* A program image is laid out as header, command records, part records
+   and string data, with all references being offsets relative to their
+   sections. Loading maps the image privately and builds all commands in
+   a single block, with strings used in place from the mapping, so that
+   processes loading the same image share its pages. */
+
+#define IMAGE_MAGIC  "PL2C"
+#define IMAGE_ALIGN  8
+#define IMAGE_FORMAT 1 /* bumped whenever records change */
+
+typedef struct st_image_header {
+  char magic[4];
+  uint16_t verMajor;
+  uint16_t verMinor;
+  uint16_t verPatch;
+  uint16_t headerSize;
+  uint16_t format;
+  char verPostfix[PL2B_SEMVER_POSTFIX_LEN + 1];
+  uint64_t sourceHash;
+  uint64_t cmdCount;
+  uint64_t partCount;
+  uint64_t cmdOffset;
+  uint64_t partOffset;
+  uint64_t strOffset;
+  uint64_t imageSize;
+} ImageHeader;
+
+typedef struct st_image_cmd {
+  uint32_t line;
+  uint32_t partCount;
+  uint64_t firstPart;
+  uint32_t group;
+  uint32_t reserved;
+} ImageCmd;
+
+typedef struct st_image_part {
+  uint64_t strOffset;
+  uint32_t strSize;
+  uint32_t isString;
+} ImagePart;
+
+static ImageHeader imageHeader(uint64_t sourceHash);
+static uint64_t alignImageOffset(uint64_t offset);
+static _Bool writeImagePadding(FILE *fp, uint64_t offset);
+static _Bool checkImageHeader(const ImageHeader *header,
+                              uint64_t sourceHash,
+                              size_t imageSize);
+static _Bool mapProgramImage(const char *path,
+                             uint64_t sourceHash,
+                             pl2b_Program *program);
+
+uint64_t pl2b_sourceHash(const char *source, size_t size) {
+  /* FNV-1a over 64-bit words, then over remaining bytes */
+  uint64_t hash = 0xcbf29ce484222325ull;
+  const uint64_t prime = 0x100000001b3ull;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, source + i, 8);
+    hash = (hash ^ word) * prime;
+    hash ^= hash >> 29;
   }
+  for (; i < size; i++) {
+    hash = (hash ^ transmuteU8(source[i])) * prime;
+  }
+  return (hash ^ size) * prime;
+}
 
-  if (cmd->resolveCache) {
-    pl2b_PCallCmdStub *stub = (pl2b_PCallCmdStub*)cmd->resolveCache;
-    if (stub == NULL) {
-      context->curCmd = cmd->next;
-      return 1;
+void pl2b_saveProgramImage(const pl2b_Program *program,
+                           uint64_t sourceHash,
+                           const char *path,
+                           pl2b_Error *error) {
+  if (program->lazy != NULL) {
+    /* only commands parsed so far could be written */
+    pl2b_errPrintf(error, PL2B_ERR_GENERAL, pl2b_sourceInfo(NULL, 0),
+                   NULL, "cannot write image of lazy program `%s`", path);
+    return;
+  }
+  ImageHeader header = imageHeader(sourceHash);
+  uint64_t strSize = 0;
+  for (pl2b_Cmd *cmd = program->commands; cmd != NULL; cmd = cmd->next) {
+    header.cmdCount += 1;
+    header.partCount += cmd->argc + 1u;
+    strSize += cmd->cmd.len + 1u;
+    for (uint32_t i = 0; i < cmd->argc; i++) {
+      strSize += cmd->args[i].len + 1u;
     }
-    pl2b_Cmd *nextCmd =
-      stub(context->program, context->userContext, cmd, error);
-    return checkNextCmdRet(context, nextCmd, error);
   }
+  header.cmdOffset = alignImageOffset(sizeof(ImageHeader));
+  header.partOffset =
+    alignImageOffset(header.cmdOffset + header.cmdCount * sizeof(ImageCmd));
+  header.strOffset =
+    alignImageOffset(header.partOffset
+                     + header.partCount * sizeof(ImagePart));
+  header.imageSize = header.strOffset + strSize;
 
-  for (pl2b_PCallCmd *iter = context->language->pCallCmds;
-       iter != NULL && !PL2B_EMPTY_CMD(iter);
-       ++iter) {
-    if (!iter->removed && !strcmp(cmd->cmd.str, iter->cmdName)) {
-      if (iter->cmdName != NULL
-          && strcmp(cmd->cmd.str, iter->cmdName) != 0) {
-        /* Do nothing if so */
-      } else if (iter->routerStub != NULL
-                 && !iter->routerStub(cmd->cmd)) {
-        /* Do nothing if so */
-      } else {
-        if (iter->deprecated) {
-          fprintf(stderr, "[int/w] using deprecated command: %s\n",
-                  iter->cmdName);
-        }
+  /* written aside and renamed, so that concurrent loaders never see a
+     partially written image, under a name unique to this writer */
+  size_t pathLen = strlen(path);
+  char *tmpPath = (char*)malloc(pathLen + 8);
+  if (tmpPath == NULL) {
+    pl2b_errPrintf(error, PL2B_ERR_MALLOC, pl2b_sourceInfo(NULL, 0),
+                   NULL, "allocation failure");
+    return;
+  }
+  sprintf(tmpPath, "%s.XXXXXX", path);
+  int fd = mkstemp(tmpPath);
+  FILE *fp = NULL;
+  if (fd >= 0) {
+    /* mkstemp creates files readable by their owner only, while images
+       are meant to be shared between workers */
+    fchmod(fd, 0644);
+    fp = fdopen(fd, "wb");
+    if (fp == NULL) {
+      close(fd);
+      remove(tmpPath);
+    }
+  }
+  if (fp == NULL) {
+    pl2b_errPrintf(error, PL2B_ERR_GENERAL, pl2b_sourceInfo(NULL, 0),
+                   NULL, "cannot open `%s` for writing", tmpPath);
+    free(tmpPath);
+    return;
+  }
 
-        cmd->resolveCache = iter->stub;
+  _Bool ok = fwrite(&header, sizeof(header), 1, fp) == 1
+             && writeImagePadding(fp, sizeof(header));
 
-        if (iter->stub == NULL) {
-          fprintf(stderr,
-                  "[int/w] entry for command %s exists but NULL\n",
-                  cmd->cmd.str);
-          context->curCmd = cmd->next;
-          return 1;
-        }
+  uint64_t firstPart = 0;
+  for (pl2b_Cmd *cmd = program->commands;
+       ok && cmd != NULL;
+       cmd = cmd->next) {
+    ImageCmd imageCmd;
+    imageCmd.line = cmd->sourceInfo.line;
+    imageCmd.partCount = cmd->argc + 1u;
+    imageCmd.firstPart = firstPart;
+    imageCmd.group = cmd->group;
+    imageCmd.reserved = 0;
+    firstPart += imageCmd.partCount;
+    ok = fwrite(&imageCmd, sizeof(imageCmd), 1, fp) == 1;
+  }
+  ok = ok && writeImagePadding(fp, header.cmdOffset
+                                   + header.cmdCount * sizeof(ImageCmd));
 
-        pl2b_Cmd *nextCmd = iter->stub(context->program,
-                                       context->userContext,
-                                       cmd,
-                                       error);
-        return checkNextCmdRet(context, nextCmd, error);
-      }
+  uint64_t strOffset = 0;
+  for (pl2b_Cmd *cmd = program->commands;
+       ok && cmd != NULL;
+       cmd = cmd->next) {
+    for (pl2b_CmdPart *part = &cmd->cmd;
+         ok && !PL2B_EMPTY_PART(*part);
+         part = part == &cmd->cmd ? cmd->args : part + 1) {
+      ImagePart imagePart;
+      imagePart.strOffset = strOffset;
+      imagePart.strSize = part->len;
+      imagePart.isString = part->isString;
+      strOffset += imagePart.strSize + 1u;
+      ok = fwrite(&imagePart, sizeof(imagePart), 1, fp) == 1;
     }
   }
+  ok = ok && writeImagePadding(fp, header.partOffset
+                                   + header.partCount * sizeof(ImagePart));
 
-  if (context->language->fallback == NULL) {
-    pl2b_errPrintf(error, PL2B_ERR_UNKNOWN_CMD, cmd->sourceInfo, NULL,
-                   "`%s` is not recognized as an internal or external "
-                   "command, operable program or batch file",
-                   cmd->cmd);
-    return 0;
+  for (pl2b_Cmd *cmd = program->commands;
+       ok && cmd != NULL;
+       cmd = cmd->next) {
+    for (pl2b_CmdPart *part = &cmd->cmd;
+         ok && !PL2B_EMPTY_PART(*part);
+         part = part == &cmd->cmd ? cmd->args : part + 1) {
+      ok = fwrite(part->str, part->len + 1u, 1, fp) == 1;
+    }
   }
 
-  pl2b_Cmd *nextCmd = context->language->fallback(
-    context->program,
-    context->userContext,
-    cmd,
-    error
-  );
+  ok = (fclose(fp) == 0) && ok;
+  if (ok && rename(tmpPath, path) != 0) {
+    ok = 0;
+  }
+  if (!ok) {
+    remove(tmpPath);
+    pl2b_errPrintf(error, PL2B_ERR_GENERAL, pl2b_sourceInfo(NULL, 0),
+                   NULL, "cannot write program image `%s`", path);
+  }
+  free(tmpPath);
+}
 
-  return checkNextCmdRet(context, nextCmd, error);
+_Bool pl2b_loadProgramImage(const char *path,
+                            uint64_t sourceHash,
+                            pl2b_Program *program) {
+  PROBE2(parse_start, path, (uint16_t)PL2B_PARSE_DENSE);
+  _Bool ret = mapProgramImage(path, sourceHash, program);
+  /* a missing or stale image ends like a failed parse */
+  PROBE2(parse_done, path,
+         (uint16_t)(ret ? PL2B_ERR_NONE : PL2B_ERR_GENERAL));
+  return ret;
 }
 
-static _Bool checkNextCmdRet(RunContext *context,
-                             pl2b_Cmd *nextCmd,
-                             pl2b_Error *error) {
-  if (pl2b_isError(error)) {
+static _Bool mapProgramImage(const char *path,
+                             uint64_t sourceHash,
+                             pl2b_Program *program) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
     return 0;
   }
-  if (nextCmd == NULL) {
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ImageHeader)) {
+    close(fd);
     return 0;
   }
-
-  context->curCmd = nextCmd;
-  return 1;
-}
-
-static _Bool loadLanguage(RunContext *context,
-                          pl2b_Cmd *cmd,
-                          pl2b_Error *error) {
-  if (context->language != NULL) {
-    pl2b_errPrintf(error, PL2B_ERR_LOAD_LANG, cmd->sourceInfo, NULL,
-                   "language: another language already loaded");
+  size_t imageSize = (size_t)st.st_size;
+  char *image = (char*)mmap(NULL, imageSize, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED) {
     return 0;
   }
 
-  uint16_t argsLen = pl2b_argsLen(cmd);
-  if (argsLen != 2) {
-    pl2b_errPrintf(error, PL2B_ERR_LOAD_LANG, cmd->sourceInfo, NULL,
-                   "language: expected 2 arguments, got %u",
-                   argsLen - 1);
+  const ImageHeader *header = (const ImageHeader*)(const void*)image;
+  if (!checkImageHeader(header, sourceHash, imageSize)) {
+    munmap(image, imageSize);
     return 0;
   }
 
-  const char *langId = cmd->args[0].str;
-  pl2b_SemVer langVer = pl2b_parseSemVer(cmd->args[1].str, error);
-  if (pl2b_isError(error)) {
-    return 0;
-  }
+  const ImageCmd *cmds =
+    (const ImageCmd*)(const void*)(image + header->cmdOffset);
+  const ImagePart *parts =
+    (const ImagePart*)(const void*)(image + header->partOffset);
+  char *strs = image + header->strOffset;
+  uint64_t strSize = header->imageSize - header->strOffset;
 
-  static char buffer[4096] = "./lib";
-  strcat(buffer, langId);
-  strcat(buffer, ".so");
-  context->libHandle = dlopen(buffer, RTLD_NOW);
-  if (context->libHandle == NULL) {
-    char *pl2Home = getenv("PL2B_HOME");
-    if (pl2Home != NULL) {
-      strcpy(buffer, pl2Home);
-      strcat(buffer, "/lib");
-      strcat(buffer, langId);
-      strcat(buffer, ".so");
-      context->libHandle = dlopen(buffer, RTLD_NOW);
+  /* commands form a dense array, and arguments of each command take
+     as many parts of the pool as the command has, including the
+     terminating empty part instead of the name */
+  Arena *arena = createArena();
+  pl2b_Cmd *block = arena == NULL ? NULL : (pl2b_Cmd*)arenaAlloc(
+    arena,
+    header->cmdCount * sizeof(pl2b_Cmd)
+      + header->partCount * sizeof(pl2b_CmdPart)
+  );
+  if (block == NULL) {
+    if (arena != NULL) {
+      dropArena(arena);
     }
-  }
-
-  if (context->libHandle == NULL) {
-    pl2b_errPrintf(error, PL2B_ERR_LOAD_LANG, cmd->sourceInfo, NULL,
-                   "language: cannot load language library `%s`: %s",
-                   langId, dlerror());
+    munmap(image, imageSize);
     return 0;
   }
+  arena->mapping = image;
+  arena->mappingSize = imageSize;
 
-  void *loadPtr = dlsym(context->libHandle, "pl2ext_loadLanguage");
-  if (loadPtr == NULL) {
-      pl2b_errPrintf(error, PL2B_ERR_LOAD_LANG, cmd->sourceInfo, NULL,
-                     "language: cannot locate `%s` "
-                     "on library `%s`: %s",
-                     "pl2ext_loadLanguage", langId, dlerror());
+  pl2b_CmdPart *partPool = (pl2b_CmdPart*)(block + header->cmdCount);
+  uint64_t firstPart = 0;
+  for (uint64_t i = 0; i < header->cmdCount; i++) {
+    const ImageCmd *imageCmd = &cmds[i];
+    if (imageCmd->partCount == 0
+        || imageCmd->firstPart != firstPart
+        || imageCmd->partCount > header->partCount - firstPart) {
+      dropArena(arena);
       return 0;
+    }
+
+    pl2b_Cmd *cmd = &block[i];
+    cmd->prev = i == 0 ? NULL : &block[i - 1];
+    cmd->next = i == header->cmdCount - 1 ? NULL : &block[i + 1];
+    cmd->args = partPool + firstPart;
+    cmd->extraData = NULL;
+    cmd->sourceInfo = pl2b_sourceInfo("<unknown-file>", imageCmd->line);
+    cmd->argc = imageCmd->partCount - 1;
+    cmd->group = imageCmd->group;
+    cmd->id = newCmdId();
+    for (uint32_t j = 0; j < imageCmd->partCount; j++) {
+      const ImagePart *part = &parts[imageCmd->firstPart + j];
+      /* written so that nothing wraps around */
+      if (part->strOffset >= strSize
+          || strSize - part->strOffset <= part->strSize
+          || part->strSize > PL2B_PART_MAX_LEN
+          || strs[part->strOffset + part->strSize] != '\0') {
+        dropArena(arena);
+        return 0;
+      }
+      pl2b_CmdPart cmdPart = pl2b_cmdPart3(strs + part->strOffset,
+                                           part->strSize,
+                                           part->isString != 0);
+      if (j == 0) {
+        cmd->cmd = cmdPart;
+      } else {
+        cmd->args[j - 1] = cmdPart;
+      }
+    }
+    cmd->args[imageCmd->partCount - 1] = pl2b_cmdPart(NULL, 0);
+    firstPart += imageCmd->partCount;
   }
 
-  pl2b_LoadLanguage *load = (pl2b_LoadLanguage*)loadPtr;
-  context->language = load(langVer, error);
-  if (pl2b_isError(error)) {
-    error->sourceInfo = cmd->sourceInfo;
+  pl2b_initProgram(program);
+  program->commands = header->cmdCount != 0 ? block : NULL;
+  program->arena = arena;
+  program->cmdCount = (size_t)header->cmdCount;
+  return 1;
+}
+
+static ImageHeader imageHeader(uint64_t sourceHash) {
+  ImageHeader ret;
+  memset(&ret, 0, sizeof(ret));
+  memcpy(ret.magic, IMAGE_MAGIC, 4);
+  ret.verMajor = PL2B_VER_MAJOR;
+  ret.verMinor = PL2B_VER_MINOR;
+  ret.verPatch = PL2B_VER_PATCH;
+  ret.headerSize = sizeof(ImageHeader);
+  ret.format = IMAGE_FORMAT;
+  strncpy(ret.verPostfix, PL2B_VER_POSTFIX, PL2B_SEMVER_POSTFIX_LEN);
+  ret.sourceHash = sourceHash;
+  return ret;
+}
+
+static uint64_t alignImageOffset(uint64_t offset) {
+  return (offset + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+}
+
+static _Bool writeImagePadding(FILE *fp, uint64_t offset) {
+  static const char zeros[IMAGE_ALIGN] = { 0 };
+  size_t paddingSize = (size_t)(alignImageOffset(offset) - offset);
+  return paddingSize == 0 || fwrite(zeros, paddingSize, 1, fp) == 1;
+}
+
+static _Bool checkImageHeader(const ImageHeader *header,
+                              uint64_t sourceHash,
+                              size_t imageSize) {
+  ImageHeader expected = imageHeader(sourceHash);
+  if (memcmp(header, &expected, offsetof(ImageHeader, cmdCount)) != 0) {
     return 0;
   }
+  /* each offset is checked against the image size before subtracting
+     it, and each count bounded before multiplying it */
+  return header->imageSize == imageSize
+         && header->cmdOffset % IMAGE_ALIGN == 0
+         && header->partOffset % IMAGE_ALIGN == 0
+         && header->cmdOffset >= sizeof(ImageHeader)
+         && header->cmdOffset <= imageSize
+         && header->cmdCount <= (imageSize - header->cmdOffset)
+                                / sizeof(ImageCmd)
+         && header->partOffset >= header->cmdOffset
+                                  + header->cmdCount * sizeof(ImageCmd)
+         && header->partOffset <= imageSize
+         && header->partCount <= (imageSize - header->partOffset)
+                                 / sizeof(ImagePart)
+         && header->strOffset >= header->partOffset
+                                 + header->partCount * sizeof(ImagePart)
+         && header->strOffset <= imageSize;
+}
 
-  if (context->language != NULL && context->language->init != NULL) {
-    context->userContext = context->language->init(error);
-    if (pl2b_isError(error)) {
-      error->sourceInfo = cmd->sourceInfo;
-      return 0;
-    }
-  }
+/*** -------------------- Semantic-ver parsing  -------------------- ***/
 
-  context->curCmd = cmd->next;
-  return 1;
+static const char *parseUint16(const char *src,
+                               uint16_t *output,
+                               pl2b_Error *error);
+
+static void parseSemVerPostfix(const char *src,
+                               char *output,
+                               pl2b_Error *error);
+
+pl2b_SemVer pl2b_zeroVersion(void) {
+  pl2b_SemVer ret;
+  ret.major = 0;
+  ret.minor = 0;
+  ret.patch = 0;
+  memset(ret.postfix, 0, PL2B_SEMVER_POSTFIX_LEN);
+  ret.exact = 0;
+  return ret;
+}
+
+pl2b_SemVer pl2b_semVer4(uint16_t major,
+                         uint16_t minor,
+                         uint16_t patch,
+                         const char *postfix) {
+  pl2b_SemVer ret = pl2b_zeroVersion();
+  ret.major = major;
+  ret.minor = minor;
+  ret.patch = patch;
+  strncpy(ret.postfix, postfix, PL2B_SEMVER_POSTFIX_LEN);
+  return ret;
+}
+
+pl2b_SemVer pl2b_version(void) {
+  return PL2B_HEADER_VERSION;
+}
+
+_Bool pl2b_isZeroVersion(pl2b_SemVer ver) {
+  return ver.major == 0
+         && ver.minor == 0
+         && ver.patch == 0
+         && ver.postfix[0] == 0
+         && ver.exact == 0;
+}
+
+_Bool pl2b_isAlpha(pl2b_SemVer ver) {
+  return ver.postfix[0] != '\0';
+}
+
+_Bool pl2b_isStable(pl2b_SemVer ver) {
+  return !pl2b_isAlpha(ver) && ver.major != 0;
+}
+
+pl2b_SemVer pl2b_parseSemVer(const char *src, pl2b_Error *error) {
+  pl2b_SemVer ret = pl2b_zeroVersion();
+  if (src[0] == '^') {
+    ret.exact = 1;
+    src++;
+  }
+
+  src = parseUint16(src, &ret.major, error);
+  if (pl2b_isError(error)) {
+    pl2b_errPrintf(error, PL2B_ERR_SEMVER_PARSE,
+                   pl2b_sourceInfo(NULL, 0), NULL,
+                   "missing major version");
+    goto done;
+  } else if (src[0] == '\0') {
+    goto done;
+  } else if (src[0] == '-') {
+    goto parse_postfix;
+  } else if (src[0] != '.') {
+    pl2b_errPrintf(error, PL2B_ERR_SEMVER_PARSE,
+                   pl2b_sourceInfo(NULL, 0), NULL,
+                   "expected `.`, got `%c`", src[0]);
+    goto done;
+  }
+
+  src++;
+  src = parseUint16(src, &ret.minor, error);
+  if (pl2b_isError(error)) {
+    pl2b_errPrintf(error, PL2B_ERR_SEMVER_PARSE,
+                   pl2b_sourceInfo(NULL, 0),
+                   NULL, "missing minor version");
+    goto done;
+  } else if (src[0] == '\0') {
+    goto done;
+  } else if (src[0] == '-') {
+    goto parse_postfix;
+  } else if (src[0] != '.') {
+    pl2b_errPrintf(error, PL2B_ERR_SEMVER_PARSE,
+                   pl2b_sourceInfo(NULL, 0), NULL,
+                   "expected `.`, got `%c`", src[0]);
+    goto done;
+  }
+
+  src++;
+  src = parseUint16(src, &ret.patch, error);
+  if (pl2b_isError(error)) {
+    pl2b_errPrintf(error, PL2B_ERR_SEMVER_PARSE,
+                   pl2b_sourceInfo(NULL, 0), NULL,
+                   "missing patch version");
+    goto done;
+  } else if (src[0] == '\0') {
+    goto done;
+  } else if (src[0] != '-') {
+    pl2b_errPrintf(error, PL2B_ERR_SEMVER_PARSE,
+                   pl2b_sourceInfo(NULL, 0), NULL,
+                   "unterminated semver, "
+                   "expected `-` or `\\0`, got `%c`",
+                   src[0]);
+    goto done;
+  }
+
+parse_postfix:
+  parseSemVerPostfix(src, ret.postfix, error);
+
+done:
+  return ret;
+}
+
+_Bool pl2b_isCompatible(pl2b_SemVer expected, pl2b_SemVer actual) {
+  if (strncmp(expected.postfix,
+              actual.postfix,
+              PL2B_SEMVER_POSTFIX_LEN) != 0) {
+    return 0;
+  }
+  if (expected.exact) {
+    return expected.major == actual.major
+           && expected.minor == actual.minor
+           && expected.patch == actual.patch;
+  } else if (expected.major == 0) {
+    /* before 1.0, every minor version may break compatibility */
+    return actual.major == 0
+           && expected.minor == actual.minor
+           && expected.patch <= actual.patch;
+  } else if (expected.major == actual.major) {
+    return (expected.minor == actual.minor
+              && expected.patch <= actual.patch)
+            || (expected.minor < actual.minor);
+  } else {
+    return 0;
+  }
+}
+
+pl2b_CmpResult pl2b_semverCmp(pl2b_SemVer ver1, pl2b_SemVer ver2) {
+  if (!strncmp(ver1.postfix, ver2.postfix, PL2B_SEMVER_POSTFIX_LEN)) {
+    return PL2B_CMP_NONE;
+  }
+
+  if (ver1.major < ver2.major) {
+    return PL2B_CMP_LESS;
+  } else if (ver1.major > ver2.major) {
+    return PL2B_CMP_GREATER;
+  } else if (ver1.minor < ver2.minor) {
+    return PL2B_CMP_LESS;
+  } else if (ver1.minor > ver2.minor) {
+    return PL2B_CMP_GREATER;
+  } else if (ver1.patch < ver2.patch) {
+    return PL2B_CMP_LESS;
+  } else if (ver1.patch > ver2.patch) {
+    return PL2B_CMP_GREATER;
+  } else {
+    return PL2B_CMP_EQ;
+  }
+}
+
+void pl2b_semverToString(pl2b_SemVer ver, char *buffer) {
+  if (ver.postfix[0]) {
+    sprintf(buffer, "%s%u.%u.%u-%s",
+            ver.exact ? "^" : "",
+            ver.major,
+            ver.minor,
+            ver.patch,
+            ver.postfix);
+  } else {
+    sprintf(buffer, "%s%u.%u.%u",
+            ver.exact ? "^" : "",
+            ver.major,
+            ver.minor,
+            ver.patch);
+  }
+}
+
+static const char *parseUint16(const char *src,
+                               uint16_t *output,
+                               pl2b_Error *error) {
+  if (!isdigit(transmuteU8(src[0]))) {
+    pl2b_errPrintf(error, PL2B_ERR_SEMVER_PARSE,
+                   pl2b_sourceInfo(NULL, 0),
+                   NULL, "expected numeric version");
+    return NULL;
+  }
+  *output = 0;
+  while (isdigit(transmuteU8(src[0]))) {
+    *output *= 10;
+    *output += src[0] - '0';
+    ++src;
+  }
+  return src;
+}
+
+static void parseSemVerPostfix(const char *src,
+                               char *output,
+                               pl2b_Error *error) {
+  assert(src[0] == '-');
+  ++src;
+  if (src[0] == '\0') {
+    pl2b_errPrintf(error, PL2B_ERR_SEMVER_PARSE,
+                   pl2b_sourceInfo(NULL, 0), NULL,
+                   "empty semver postfix");
+    return;
+  }
+  for (size_t i = 0; i < PL2B_SEMVER_POSTFIX_LEN - 1; i++) {
+    if (!(*output++ = *src++)) {
+      return;
+    }
+  }
+  if (src[0] != '\0') {
+    pl2b_errPrintf(error, PL2B_ERR_SEMVER_PARSE,
+                   pl2b_sourceInfo(NULL, 0), NULL,
+                   "semver postfix too long");
+    return;
+  }
+}
+
+/*** --------------- Implementation of dispatch table -------------- ***/
+
+/* Built from `pCallCmds` once a language gets loaded. Commands are
+   bound to an entry index by the link pass, which keeps a record of it
+   in the bindings of the run, so that running a bound command, builtins
+   included, takes no string comparison. */
+
+#define DISPATCH_MIN_BUCKETS 16
+
+#define DISPATCH_LANGUAGE 0
+#define DISPATCH_ABORT    1
+#define DISPATCH_FALLBACK 2
+#define DISPATCH_FIRST    3 /* index of first item of `pCallCmds` */
+#define DISPATCH_UNBOUND  0xffffffffu
+
+typedef struct st_dispatch_entry {
+  pl2b_PCallCmdStub *stub;  /* NULL if entry exists but has no stub */
+  pl2b_PCallCmd *pCallCmd;  /* NULL for builtins and fallback */
+  uint64_t hash;
+  size_t nameLen;
+} DispatchEntry;
+
+typedef struct st_dispatch_table {
+  DispatchEntry *entries;
+  uint32_t namedCount;
+  uint32_t *buckets;       /* entry index plus one, 0 for empty bucket */
+  uint32_t bucketCount;
+  uint32_t *routers;       /* indices of entries without `cmdName` */
+  uint32_t routerCount;
+} DispatchTable;
+
+static DispatchTable *createDispatchTable(pl2b_Language *language);
+static uint32_t resolveBuiltin(const pl2b_Cmd *cmd);
+/* returns DISPATCH_UNBOUND for unknown commands, or the entry of a
+   removed command if there is no other match and no fallback */
+static uint32_t resolveDispatch(const DispatchTable *table,
+                                const pl2b_Cmd *cmd);
+static void dropDispatchTable(DispatchTable *table);
+
+static DispatchTable *createDispatchTable(pl2b_Language *language) {
+  uint32_t count = DISPATCH_FIRST;
+  for (pl2b_PCallCmd *iter = language->pCallCmds;
+       iter != NULL && !PL2B_EMPTY_CMD(iter);
+       ++iter) {
+    count++;
+  }
+
+  uint32_t bucketCount = DISPATCH_MIN_BUCKETS;
+  while (bucketCount < count * 2) {
+    bucketCount *= 2;
+  }
+
+  DispatchTable *ret = (DispatchTable*)malloc(sizeof(DispatchTable));
+  if (ret == NULL) {
+    return NULL;
+  }
+  ret->entries = (DispatchEntry*)calloc(count, sizeof(DispatchEntry));
+  ret->namedCount = 0;
+  ret->buckets = (uint32_t*)calloc(bucketCount, sizeof(uint32_t));
+  ret->bucketCount = bucketCount;
+  ret->routers = (uint32_t*)malloc(count * sizeof(uint32_t));
+  ret->routerCount = 0;
+  if (ret->entries == NULL || ret->buckets == NULL
+      || ret->routers == NULL) {
+    dropDispatchTable(ret);
+    return NULL;
+  }
+  ret->entries[DISPATCH_FALLBACK].stub = language->fallback;
+
+  /* entries sharing a name are inserted in declaration order, and
+     linear probing keeps them in that order along the probe sequence */
+  for (uint32_t i = DISPATCH_FIRST; i < count; i++) {
+    pl2b_PCallCmd *pCallCmd = &language->pCallCmds[i - DISPATCH_FIRST];
+    DispatchEntry *entry = &ret->entries[i];
+    entry->stub = pCallCmd->stub;
+    entry->pCallCmd = pCallCmd;
+    if (pCallCmd->cmdName == NULL) {
+      if (!pCallCmd->removed) {
+        ret->routers[ret->routerCount++] = i;
+      }
+      continue;
+    }
+
+    entry->nameLen = strlen(pCallCmd->cmdName);
+    entry->hash = symbolHash(pCallCmd->cmdName, entry->nameLen);
+    uint32_t mask = bucketCount - 1;
+    uint32_t idx = (uint32_t)entry->hash & mask;
+    while (ret->buckets[idx] != 0) {
+      idx = (idx + 1) & mask;
+    }
+    ret->buckets[idx] = i + 1;
+    ret->namedCount++;
+  }
+  return ret;
+}
+
+/* returns DISPATCH_FALLBACK for non-builtin commands */
+static uint32_t resolveBuiltin(const pl2b_Cmd *cmd) {
+  uint32_t symbol = cmd->cmd.symbol;
+  if (symbol == PL2B_SYM_NONE) {
+    if (cmd->cmd.len == 8 && !memcmp(cmd->cmd.str, "language", 8)) {
+      symbol = PL2B_SYM_LANGUAGE;
+    } else if (cmd->cmd.len == 5 && !memcmp(cmd->cmd.str, "abort", 5)) {
+      symbol = PL2B_SYM_ABORT;
+    }
+  }
+
+  if (symbol == PL2B_SYM_LANGUAGE) {
+    return DISPATCH_LANGUAGE;
+  } else if (symbol == PL2B_SYM_ABORT) {
+    return DISPATCH_ABORT;
+  }
+  return DISPATCH_FALLBACK;
+}
+
+static uint32_t resolveDispatch(const DispatchTable *table,
+                                const pl2b_Cmd *cmd) {
+  uint64_t hash = table->namedCount != 0
+                  ? symbolHash(cmd->cmd.str, cmd->cmd.len)
+                  : 0;
+  uint32_t mask = table->bucketCount - 1;
+  uint32_t found = DISPATCH_FALLBACK;
+  uint32_t removed = DISPATCH_UNBOUND;
+  for (uint32_t idx = (uint32_t)hash & mask;
+       table->buckets[idx] != 0;
+       idx = (idx + 1) & mask) {
+    const DispatchEntry *entry = &table->entries[table->buckets[idx] - 1];
+    if (entry->hash != hash
+        || entry->nameLen != cmd->cmd.len
+        || memcmp(entry->pCallCmd->cmdName, cmd->cmd.str, cmd->cmd.len)) {
+      continue;
+    }
+    if (entry->pCallCmd->removed) {
+      if (removed == DISPATCH_UNBOUND) {
+        removed = table->buckets[idx] - 1;
+      }
+    } else if (entry->pCallCmd->routerStub == NULL
+               || entry->pCallCmd->routerStub(cmd->cmd)) {
+      found = table->buckets[idx] - 1;
+      break;
+    }
+  }
+
+  /* nameless entries declared before the named match take priority */
+  for (uint32_t i = 0; i < table->routerCount; i++) {
+    uint32_t routerIdx = table->routers[i];
+    if (found != DISPATCH_FALLBACK && routerIdx > found) {
+      break;
+    }
+    const pl2b_PCallCmd *pCallCmd = table->entries[routerIdx].pCallCmd;
+    if (pCallCmd->routerStub == NULL || pCallCmd->routerStub(cmd->cmd)) {
+      return routerIdx;
+    }
+  }
+
+  if (found == DISPATCH_FALLBACK
+      && table->entries[DISPATCH_FALLBACK].stub == NULL) {
+    return removed;
+  }
+  return found;
+}
+
+static void dropDispatchTable(DispatchTable *table) {
+  free(table->entries);
+  free(table->buckets);
+  free(table->routers);
+  free(table);
+}
+
+/*** -------------- Implementation of language registry ------------- ***/
+
+/* Language libraries stay loaded once a run loads them, so that later
+   runs skip `dlopen`, `pl2ext_loadLanguage` and building the dispatch
+   table, which is never modified after creation and may be shared by
+   concurrent runs. Modules are keyed by language id, resolved library
+   path and version text, and counted by the runs using them. Evicted
+   modules leave the registry at once, and get unloaded as soon as no
+   run uses them.
+   A module enters the registry marked `loading` before its library is
+   opened, and the registry lock is released while opening it, so that
+   loaders may use the registry themselves. Runs wanting the same module
+   meanwhile wait on `registryCond`. */
+
+typedef struct st_language_module {
+  char *langId;
+  char *path;               /* as resolved by `realpath` */
+  char *version;            /* as written in `language` command */
+  void *libHandle;
+  pl2b_Language *language;
+  DispatchTable *dispatch;  /* NULL if `language` is NULL */
+  uint32_t refCount;
+  _Bool evicted;
+  _Bool loading;
+  pthread_t loader;         /* thread opening the module while `loading` */
+  struct st_language_module *next;
+} LanguageModule;
+
+static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t registryCond = PTHREAD_COND_INITIALIZER;
+static LanguageModule *registry;
+
+static LanguageModule *acquireModule(const char *langId,
+                                     const char *version,
+                                     pl2b_SourceInfo sourceInfo,
+                                     pl2b_Error *error);
+static void releaseModule(LanguageModule *module);
+static LanguageModule *findModule(const char *langId,
+                                  const char *path,
+                                  const char *version);
+static void unlinkModule(LanguageModule *module);
+static LanguageModule *createModule(const char *langId,
+                                    char *path,
+                                    const char *version,
+                                    pl2b_SourceInfo sourceInfo,
+                                    pl2b_Error *error);
+static _Bool openModule(LanguageModule *module,
+                        pl2b_SourceInfo sourceInfo,
+                        pl2b_Error *error);
+static void closeModule(LanguageModule *module);
+static char *resolveLibrary(const char *langId);
+
+size_t pl2b_evictLanguages(const char *langId) {
+  size_t ret = 0;
+  pthread_mutex_lock(&registryLock);
+  LanguageModule **iter = &registry;
+  while (*iter != NULL) {
+    LanguageModule *module = *iter;
+    if (langId != NULL && strcmp(module->langId, langId)) {
+      iter = &module->next;
+      continue;
+    }
+
+    *iter = module->next;
+    if (module->refCount == 0) {
+      closeModule(module);
+    } else {
+      module->evicted = 1;
+    }
+    ret++;
+  }
+  pthread_mutex_unlock(&registryLock);
+  return ret;
+}
+
+static LanguageModule *acquireModule(const char *langId,
+                                     const char *version,
+                                     pl2b_SourceInfo sourceInfo,
+                                     pl2b_Error *error) {
+  char *path = resolveLibrary(langId);
+  if (path == NULL) {
+    pl2b_errPrintf(error, PL2B_ERR_LOAD_LANG, sourceInfo, NULL,
+                   "language: cannot load language library `%s`: %s",
+                   langId, strerror(errno));
+    return NULL;
+  }
+
+  pthread_mutex_lock(&registryLock);
+  LanguageModule *module = findModule(langId, path, version);
+  while (module != NULL && module->loading) {
+    if (pthread_equal(module->loader, pthread_self())) {
+      pthread_mutex_unlock(&registryLock);
+      free(path);
+      pl2b_errPrintf(error, PL2B_ERR_LOAD_LANG, sourceInfo, NULL,
+                     "language: `%s` is used while loading itself",
+                     langId);
+      return NULL;
+    }
+    pthread_cond_wait(&registryCond, &registryLock);
+    /* gone if loading failed or it got evicted, then load it anew */
+    module = findModule(langId, path, version);
+  }
+  if (module != NULL) {
+    module->refCount++;
+    pthread_mutex_unlock(&registryLock);
+    free(path);
+    return module;
+  }
+
+  module = createModule(langId, path, version, sourceInfo, error);
+  if (module == NULL) {
+    pthread_mutex_unlock(&registryLock);
+    return NULL;
+  }
+  module->refCount = 1;
+  module->loading = 1;
+  module->loader = pthread_self();
+  module->next = registry;
+  registry = module;
+  pthread_mutex_unlock(&registryLock);
+
+  PROBE2(lang_load_start, langId, version);
+  _Bool opened = openModule(module, sourceInfo, error);
+  PROBE2(lang_load_done, langId, error->errorCode);
+
+  pthread_mutex_lock(&registryLock);
+  module->loading = 0;
+  if (!opened) {
+    /* unless evicted meanwhile, which already unlinked it */
+    if (!module->evicted) {
+      unlinkModule(module);
+    }
+    closeModule(module);
+    module = NULL;
+  }
+  pthread_cond_broadcast(&registryCond);
+  pthread_mutex_unlock(&registryLock);
+  return module;
+}
+
+static void releaseModule(LanguageModule *module) {
+  pthread_mutex_lock(&registryLock);
+  module->refCount--;
+  if (module->refCount == 0 && module->evicted) {
+    closeModule(module);
+  }
+  pthread_mutex_unlock(&registryLock);
+}
+
+static LanguageModule *findModule(const char *langId,
+                                  const char *path,
+                                  const char *version) {
+  LanguageModule *module = registry;
+  while (module != NULL
+         && (strcmp(module->path, path)
+             || strcmp(module->langId, langId)
+             || strcmp(module->version, version))) {
+    module = module->next;
+  }
+  return module;
+}
+
+static void unlinkModule(LanguageModule *module) {
+  LanguageModule **iter = &registry;
+  while (*iter != module) {
+    iter = &(*iter)->next;
+  }
+  *iter = module->next;
+}
+
+/* takes ownership of `path` */
+static LanguageModule *createModule(const char *langId,
+                                    char *path,
+                                    const char *version,
+                                    pl2b_SourceInfo sourceInfo,
+                                    pl2b_Error *error) {
+  LanguageModule *ret = (LanguageModule*)malloc(sizeof(LanguageModule));
+  if (ret == NULL) {
+    free(path);
+    pl2b_errPrintf(error, PL2B_ERR_MALLOC, sourceInfo, NULL,
+                   "language: cannot allocate memory for module");
+    return NULL;
+  }
+  ret->langId = strdup(langId);
+  ret->path = path;
+  ret->version = strdup(version);
+  ret->libHandle = NULL;
+  ret->language = NULL;
+  ret->dispatch = NULL;
+  ret->refCount = 0;
+  ret->evicted = 0;
+  ret->loading = 0;
+  ret->next = NULL;
+  if (ret->langId == NULL || ret->version == NULL) {
+    pl2b_errPrintf(error, PL2B_ERR_MALLOC, sourceInfo, NULL,
+                   "language: cannot allocate memory for module");
+    closeModule(ret);
+    return NULL;
+  }
+  return ret;
+}
+
+/* called without `registryLock`; on failure, caller closes `module` */
+static _Bool openModule(LanguageModule *module,
+                        pl2b_SourceInfo sourceInfo,
+                        pl2b_Error *error) {
+  pl2b_SemVer langVer = pl2b_parseSemVer(module->version, error);
+  if (pl2b_isError(error)) {
+    return 0;
+  }
+
+  module->libHandle = dlopen(module->path, RTLD_NOW);
+  if (module->libHandle == NULL) {
+    pl2b_errPrintf(error, PL2B_ERR_LOAD_LANG, sourceInfo, NULL,
+                   "language: cannot load language library `%s`: %s",
+                   module->langId, dlerror());
+    return 0;
+  }
+
+  void *loadPtr = dlsym(module->libHandle, "pl2ext_loadLanguage");
+  if (loadPtr == NULL) {
+    pl2b_errPrintf(error, PL2B_ERR_LOAD_LANG, sourceInfo, NULL,
+                   "language: cannot locate `%s` on library `%s`: %s",
+                   "pl2ext_loadLanguage", module->langId, dlerror());
+    return 0;
+  }
+
+  pl2b_LoadLanguage *load = (pl2b_LoadLanguage*)loadPtr;
+  module->language = load(langVer, error);
+  if (pl2b_isError(error)) {
+    error->sourceInfo = sourceInfo;
+    return 0;
+  }
+
+  if (module->language != NULL) {
+    module->dispatch = createDispatchTable(module->language);
+    if (module->dispatch == NULL) {
+      pl2b_errPrintf(error, PL2B_ERR_MALLOC, sourceInfo, NULL,
+                     "language: cannot allocate memory for "
+                     "dispatch table");
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void closeModule(LanguageModule *module) {
+  if (module->dispatch != NULL) {
+    dropDispatchTable(module->dispatch);
+  }
+  if (module->libHandle != NULL && dlclose(module->libHandle) != 0) {
+    fprintf(stderr, "[int/e] error invoking dlclose: %s\n", dlerror());
+  }
+  free(module->langId);
+  free(module->path);
+  free(module->version);
+  free(module);
+}
+
+/* `./lib<langId>.so`, or `lib<langId>.so` under `PL2B_HOME` */
+static char *resolveLibrary(const char *langId) {
+  char buffer[4096];
+  snprintf(buffer, sizeof(buffer), "./lib%s.so", langId);
+  char *ret = realpath(buffer, NULL);
+  if (ret == NULL) {
+    char *pl2Home = getenv("PL2B_HOME");
+    if (pl2Home != NULL) {
+      int savedErrno = errno;
+      snprintf(buffer, sizeof(buffer), "%s/lib%s.so", pl2Home, langId);
+      ret = realpath(buffer, NULL);
+      if (ret == NULL) {
+        errno = savedErrno;
+      }
+    }
+  }
+  return ret;
+}
+
+/*** ------------------ Implementation of block pool ----------------- ***/
+
+/* Tasks of `?parallel` blocks run on a process-wide pool of detached
+   threads, started on first use with one thread per online CPU unless
+   environment variable `PL2B_POOL_THREADS` says otherwise. A job is
+   cut into one range of task indices per thread that may take part,
+   and a thread drains its own range from the front before stealing
+   from the back of others. The submitting thread takes part as well,
+   so jobs complete even if no thread could be started. */
+
+#define POOL_MAX_THREADS 64
+
+typedef void (PoolWork)(void *arg, uint32_t idx);
+
+typedef struct st_pool_range {
+  pthread_mutex_t lock;
+  uint32_t lo;
+  uint32_t hi;
+} PoolRange;
+
+typedef struct st_pool_job {
+  PoolWork *work;
+  void *arg;
+  PoolRange *ranges;
+  uint32_t rangeCount;
+  uint32_t joined;      /* threads having taken part, picking ranges */
+  uint32_t working;     /* pool threads still inside the job */
+  uint32_t unfinished;  /* tasks not yet done */
+  struct st_pool_job *next;
+} PoolJob;
+
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolWake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t poolDone = PTHREAD_COND_INITIALIZER;
+static PoolJob *poolJobs;    /* jobs possibly having tasks left */
+static uint32_t poolThreadCount;
+static _Bool poolStarted;
+
+static void poolRun(PoolWork *work, void *arg, uint32_t count);
+static void startPool(void);
+static void *poolThread(void *arg);
+static uint32_t workOnJob(PoolJob *job, uint32_t own);
+static _Bool takeTask(PoolRange *range, _Bool steal, uint32_t *idx);
+static void unqueueJob(PoolJob *job);
+
+/* Runs `work` for every index below `count`, returning once all done */
+static void poolRun(PoolWork *work, void *arg, uint32_t count) {
+  pthread_mutex_lock(&poolLock);
+  if (!poolStarted) {
+    startPool();
+  }
+  uint32_t rangeCount = poolThreadCount + 1;
+  pthread_mutex_unlock(&poolLock);
+  if (rangeCount > count) {
+    rangeCount = count;
+  }
+
+  PoolRange *ranges = rangeCount > 1
+                      ? (PoolRange*)malloc(rangeCount * sizeof(PoolRange))
+                      : NULL;
+  if (ranges == NULL) {
+    for (uint32_t i = 0; i < count; i++) {
+      work(arg, i);
+    }
+    return;
+  }
+  for (uint32_t i = 0; i < rangeCount; i++) {
+    pthread_mutex_init(&ranges[i].lock, NULL);
+    ranges[i].lo = (uint32_t)((uint64_t)count * i / rangeCount);
+    ranges[i].hi = (uint32_t)((uint64_t)count * (i + 1) / rangeCount);
+  }
+
+  PoolJob job;
+  job.work = work;
+  job.arg = arg;
+  job.ranges = ranges;
+  job.rangeCount = rangeCount;
+  job.joined = 1;
+  job.working = 0;
+  job.unfinished = count;
+  job.next = NULL;
+
+  pthread_mutex_lock(&poolLock);
+  PoolJob **tail = &poolJobs;
+  while (*tail != NULL) {
+    tail = &(*tail)->next;
+  }
+  *tail = &job;
+  pthread_cond_broadcast(&poolWake);
+  pthread_mutex_unlock(&poolLock);
+
+  uint32_t done = workOnJob(&job, 0);
+
+  pthread_mutex_lock(&poolLock);
+  unqueueJob(&job);
+  job.unfinished -= done;
+  while (job.unfinished != 0 || job.working != 0) {
+    pthread_cond_wait(&poolDone, &poolLock);
+  }
+  pthread_mutex_unlock(&poolLock);
+
+  for (uint32_t i = 0; i < rangeCount; i++) {
+    pthread_mutex_destroy(&ranges[i].lock);
+  }
+  free(ranges);
+}
+
+/* called with `poolLock` held */
+static void startPool(void) {
+  poolStarted = 1;
+
+  long want = 0;
+  const char *forced = getenv("PL2B_POOL_THREADS");
+  if (forced != NULL && *forced != '\0') {
+    want = strtol(forced, NULL, 10);
+  } else {
+    want = sysconf(_SC_NPROCESSORS_ONLN);
+    if (want < 1) {
+      want = 1;
+    }
+  }
+  if (want > POOL_MAX_THREADS) {
+    want = POOL_MAX_THREADS;
+  }
+
+  pthread_attr_t attr;
+  if (want <= 0 || pthread_attr_init(&attr) != 0) {
+    return;
+  }
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for (long i = 0; i < want; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, poolThread, NULL) != 0) {
+      break;
+    }
+    poolThreadCount++;
+  }
+  pthread_attr_destroy(&attr);
+}
+
+static void *poolThread(void *arg) {
+  (void)arg;
+
+  pthread_mutex_lock(&poolLock);
+  while (1) {
+    while (poolJobs == NULL) {
+      pthread_cond_wait(&poolWake, &poolLock);
+    }
+    PoolJob *job = poolJobs;
+    uint32_t own = job->joined++ % job->rangeCount;
+    job->working++;
+    pthread_mutex_unlock(&poolLock);
+
+    uint32_t done = workOnJob(job, own);
+
+    pthread_mutex_lock(&poolLock);
+    /* nothing is left to take once back */
+    unqueueJob(job);
+    job->unfinished -= done;
+    job->working--;
+    if (job->working == 0 && job->unfinished == 0) {
+      pthread_cond_broadcast(&poolDone);
+    }
+  }
+  return NULL;
+}
+
+/* Returns the count of tasks done, once no range has tasks left */
+static uint32_t workOnJob(PoolJob *job, uint32_t own) {
+  uint32_t done = 0;
+  while (1) {
+    uint32_t idx;
+    _Bool taken = takeTask(&job->ranges[own], 0, &idx);
+    for (uint32_t i = 1; !taken && i < job->rangeCount; i++) {
+      taken = takeTask(&job->ranges[(own + i) % job->rangeCount], 1, &idx);
+    }
+    if (!taken) {
+      return done;
+    }
+    job->work(job->arg, idx);
+    done++;
+  }
+}
+
+static _Bool takeTask(PoolRange *range, _Bool steal, uint32_t *idx) {
+  pthread_mutex_lock(&range->lock);
+  _Bool ret = range->lo < range->hi;
+  if (ret) {
+    *idx = steal ? --range->hi : range->lo++;
+  }
+  pthread_mutex_unlock(&range->lock);
+  return ret;
+}
+
+/* called with `poolLock` held */
+static void unqueueJob(PoolJob *job) {
+  for (PoolJob **iter = &poolJobs; *iter != NULL; iter = &(*iter)->next) {
+    if (*iter == job) {
+      *iter = job->next;
+      return;
+    }
+  }
+}
+
+/*** ------------------- Implementation of profiling ----------------- ***/
+
+/* Runs with a profile keep one slot per threaded record, written by
+   their own thread only, and add slots to the profile once they end.
+   The profile is keyed by command name, interned in the profile, and
+   source line. Runs resolve the key of each record as soon as it gets
+   emitted, since stubs may free commands before the run ends. Times
+   are taken in clock ticks, being the TSC on x86 and nanoseconds
+   otherwise, and converted to nanoseconds when writing, by scaling
+   against CLOCK_MONOTONIC since the profile got created.
+
+   The clock is read once per command, after its stub: the end of one
+   stub is where dispatching the next one starts. Dispatch is measured
+   apart on one in `PROFILE_DISPATCH_SAMPLE` calls of a record only,
+   and its estimate over all calls is taken off the stub time when the
+   run adds its slots. */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define PROFILE_TSC
+#endif
+
+#define PROFILE_MIN_ENTRIES     64
+#define PROFILE_DISPATCH_SAMPLE 64
+
+typedef struct st_profile_slot {
+  uint64_t calls;
+  uint64_t stubTicks;
+  uint64_t minTicks;
+  uint64_t maxTicks;
+  uint64_t dispatchTicks;
+  uint64_t dispatchSamples; /* calls `dispatchTicks` got measured on */
+} ProfileSlot;
+
+/* profile key of a threaded record */
+typedef struct st_profile_key {
+  uint32_t nameIdx;    /* UINT32_MAX if it could not be interned */
+  uint32_t line;
+} ProfileKey;
+
+typedef struct st_profile_entry {
+  uint32_t nameIdx;
+  uint32_t line;       /* 0 for sums per name */
+  ProfileSlot slot;
+} ProfileEntry;
+
+struct st_pl2b_profile {
+  pthread_mutex_t lock;
+  ProfileEntry *entries;
+  uint32_t entryCount;
+  uint32_t entryCap;
+  uint32_t *buckets;     /* entry index plus one, 0 for empty bucket */
+  uint32_t bucketCount;
+  char **names;
+  uint32_t nameCount;
+  uint32_t nameCap;
+  uint32_t *nameBuckets; /* name index plus one, 0 for empty bucket */
+  uint32_t nameBucketCount;
+  uint64_t startTicks;
+  uint64_t startNanos;
+};
+
+static inline uint64_t profileClock(void);
+static uint64_t profileNanos(void);
+static void addProfileTicks(ProfileSlot *slot, uint64_t ticks);
+static void sumProfileSlot(ProfileSlot *sum, const ProfileSlot *slot);
+static void estimateDispatch(ProfileSlot *slot);
+static _Bool addProfileSlot(pl2b_Profile *profile,
+                            uint32_t nameIdx,
+                            uint32_t line,
+                            const ProfileSlot *slot);
+static uint32_t internProfileName(pl2b_Profile *profile,
+                                  const char *name);
+static _Bool growProfile(pl2b_Profile *profile);
+static _Bool growProfileNames(pl2b_Profile *profile);
+static uint32_t hashProfileKey(uint32_t nameIdx, uint32_t line);
+static uint32_t hashProfileName(const char *name);
+static double profileScale(const pl2b_Profile *profile);
+static ProfileEntry *profileByName(const pl2b_Profile *profile);
+static const ProfileEntry **sortedEntries(const ProfileEntry *entries,
+                                          uint32_t count);
+static int cmpEntryByTime(const void *lhs, const void *rhs);
+static void writeReportLine(FILE *fp,
+                            const pl2b_Profile *profile,
+                            const ProfileEntry *entry,
+                            double scale);
+
+pl2b_Profile *pl2b_createProfile(void) {
+  pl2b_Profile *ret = (pl2b_Profile*)malloc(sizeof(pl2b_Profile));
+  if (ret == NULL) {
+    return NULL;
+  }
+  pthread_mutex_init(&ret->lock, NULL);
+  ret->entries = NULL;
+  ret->entryCount = 0;
+  ret->entryCap = 0;
+  ret->buckets = NULL;
+  ret->bucketCount = 0;
+  ret->names = NULL;
+  ret->nameCount = 0;
+  ret->nameCap = 0;
+  ret->nameBuckets = NULL;
+  ret->nameBucketCount = 0;
+  ret->startTicks = profileClock();
+  ret->startNanos = profileNanos();
+  return ret;
+}
+
+void pl2b_dropProfile(pl2b_Profile *profile) {
+  for (uint32_t i = 0; i < profile->nameCount; i++) {
+    free(profile->names[i]);
+  }
+  free(profile->names);
+  free(profile->nameBuckets);
+  free(profile->entries);
+  free(profile->buckets);
+  pthread_mutex_destroy(&profile->lock);
+  free(profile);
+}
+
+void pl2b_writeProfileReport(pl2b_Profile *profile,
+                             const char *path,
+                             pl2b_Error *error) {
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) {
+    pl2b_errPrintf(error, PL2B_ERR_GENERAL, pl2b_sourceInfo(NULL, 0),
+                   NULL, "profile: cannot open %s for writing", path);
+    return;
+  }
+
+  pthread_mutex_lock(&profile->lock);
+  double scale = profileScale(profile);
+  ProfileEntry *sums = profileByName(profile);
+  const ProfileEntry **byName =
+    sums != NULL ? sortedEntries(sums, profile->nameCount) : NULL;
+  const ProfileEntry **byLine =
+    sortedEntries(profile->entries, profile->entryCount);
+
+  _Bool ok = byName != NULL && byLine != NULL;
+  if (ok) {
+    fprintf(fp, "%12s %12s %10s %10s %10s %12s  %s\n",
+            "calls", "total ms", "avg ns", "min ns", "max ns",
+            "dispatch ms", "command");
+    for (uint32_t i = 0; i < profile->nameCount; i++) {
+      writeReportLine(fp, profile, byName[i], scale);
+    }
+    fprintf(fp, "\n%12s %12s %10s %10s %10s %12s  %s\n",
+            "calls", "total ms", "avg ns", "min ns", "max ns",
+            "dispatch ms", "command:line");
+    for (uint32_t i = 0; i < profile->entryCount; i++) {
+      writeReportLine(fp, profile, byLine[i], scale);
+    }
+  }
+  pthread_mutex_unlock(&profile->lock);
+  free(sums);
+  free(byName);
+  free(byLine);
+  if (fclose(fp) != 0 || !ok) {
+    pl2b_errPrintf(error, PL2B_ERR_GENERAL, pl2b_sourceInfo(NULL, 0),
+                   NULL, "profile: cannot write report to %s", path);
+  }
+}
+
+/* One stack per command and line for stub time, and one more under
+   `[dispatch]` for dispatch time, counting nanoseconds */
+void pl2b_writeProfileFolded(pl2b_Profile *profile,
+                             const char *path,
+                             pl2b_Error *error) {
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) {
+    pl2b_errPrintf(error, PL2B_ERR_GENERAL, pl2b_sourceInfo(NULL, 0),
+                   NULL, "profile: cannot open %s for writing", path);
+    return;
+  }
+
+  pthread_mutex_lock(&profile->lock);
+  double scale = profileScale(profile);
+  for (uint32_t i = 0; i < profile->entryCount; i++) {
+    const ProfileEntry *entry = &profile->entries[i];
+    const char *name = profile->names[entry->nameIdx];
+    uint64_t stubNanos = (uint64_t)((double)entry->slot.stubTicks * scale);
+    uint64_t dispatchNanos =
+      (uint64_t)((double)entry->slot.dispatchTicks * scale);
+    if (stubNanos != 0) {
+      fprintf(fp, "%s;%s:%u %llu\n", name, name, entry->line,
+              (unsigned long long)stubNanos);
+    }
+    if (dispatchNanos != 0) {
+      fprintf(fp, "[dispatch];%s:%u %llu\n", name, entry->line,
+              (unsigned long long)dispatchNanos);
+    }
+  }
+  pthread_mutex_unlock(&profile->lock);
+  if (fclose(fp) != 0) {
+    pl2b_errPrintf(error, PL2B_ERR_GENERAL, pl2b_sourceInfo(NULL, 0),
+                   NULL, "profile: cannot write folded stacks to %s",
+                   path);
+  }
+}
+
+static inline uint64_t profileClock(void) {
+#ifdef PROFILE_TSC
+  return __rdtsc();
+#else
+  return profileNanos();
+#endif
+}
+
+static uint64_t profileNanos(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void addProfileTicks(ProfileSlot *slot, uint64_t ticks) {
+  if (slot->calls == 0 || ticks < slot->minTicks) {
+    slot->minTicks = ticks;
+  }
+  if (ticks > slot->maxTicks) {
+    slot->maxTicks = ticks;
+  }
+  slot->calls++;
+  slot->stubTicks += ticks;
+}
+
+static void sumProfileSlot(ProfileSlot *sum, const ProfileSlot *slot) {
+  if (sum->calls == 0 || slot->minTicks < sum->minTicks) {
+    sum->minTicks = slot->minTicks;
+  }
+  if (slot->maxTicks > sum->maxTicks) {
+    sum->maxTicks = slot->maxTicks;
+  }
+  sum->calls += slot->calls;
+  sum->stubTicks += slot->stubTicks;
+  sum->dispatchTicks += slot->dispatchTicks;
+  sum->dispatchSamples += slot->dispatchSamples;
+}
+
+/* Scales sampled dispatch of `slot` up to all of its calls and takes it
+   off the stub times, which it got measured within */
+static void estimateDispatch(ProfileSlot *slot) {
+  uint64_t mean = slot->dispatchSamples != 0
+                  ? slot->dispatchTicks / slot->dispatchSamples
+                  : 0;
+  uint64_t dispatch = mean * slot->calls;
+  slot->stubTicks -= dispatch < slot->stubTicks ? dispatch : slot->stubTicks;
+  slot->minTicks -= mean < slot->minTicks ? mean : slot->minTicks;
+  slot->maxTicks -= mean < slot->maxTicks ? mean : slot->maxTicks;
+  slot->dispatchTicks = dispatch;
+  slot->dispatchSamples = slot->calls;
+}
+
+/* called with `profile->lock` held */
+static _Bool addProfileSlot(pl2b_Profile *profile,
+                            uint32_t nameIdx,
+                            uint32_t line,
+                            const ProfileSlot *slot) {
+  uint32_t hash = hashProfileKey(nameIdx, line);
+  uint32_t mask = profile->bucketCount - 1;
+  uint32_t idx = hash & mask;
+  for (; profile->bucketCount != 0 && profile->buckets[idx] != 0;
+       idx = (idx + 1) & mask) {
+    ProfileEntry *entry = &profile->entries[profile->buckets[idx] - 1];
+    if (entry->nameIdx == nameIdx && entry->line == line) {
+      sumProfileSlot(&entry->slot, slot);
+      return 1;
+    }
+  }
+
+  if (profile->entryCount == profile->entryCap
+      || (profile->entryCount + 1) * 2 > profile->bucketCount) {
+    if (!growProfile(profile)) {
+      return 0;
+    }
+    mask = profile->bucketCount - 1;
+    for (idx = hash & mask;
+         profile->buckets[idx] != 0;
+         idx = (idx + 1) & mask);
+  }
+
+  ProfileEntry *entry = &profile->entries[profile->entryCount++];
+  entry->nameIdx = nameIdx;
+  entry->line = line;
+  entry->slot = *slot;
+  profile->buckets[idx] = profile->entryCount;
+  return 1;
+}
+
+/* Returns the name index, or UINT32_MAX if out of memory. Called with
+   `profile->lock` held. */
+static uint32_t internProfileName(pl2b_Profile *profile,
+                                  const char *name) {
+  uint32_t hash = hashProfileName(name);
+  uint32_t mask = profile->nameBucketCount - 1;
+  uint32_t idx = hash & mask;
+  for (; profile->nameBucketCount != 0 && profile->nameBuckets[idx] != 0;
+       idx = (idx + 1) & mask) {
+    uint32_t nameIdx = profile->nameBuckets[idx] - 1;
+    if (!strcmp(profile->names[nameIdx], name)) {
+      return nameIdx;
+    }
+  }
+
+  if (profile->nameCount == profile->nameCap
+      || (profile->nameCount + 1) * 2 > profile->nameBucketCount) {
+    if (!growProfileNames(profile)) {
+      return UINT32_MAX;
+    }
+    mask = profile->nameBucketCount - 1;
+    for (idx = hash & mask;
+         profile->nameBuckets[idx] != 0;
+         idx = (idx + 1) & mask);
+  }
+
+  char *copy = strdup(name);
+  if (copy == NULL) {
+    return UINT32_MAX;
+  }
+  profile->names[profile->nameCount++] = copy;
+  profile->nameBuckets[idx] = profile->nameCount;
+  return profile->nameCount - 1;
+}
+
+static _Bool growProfile(pl2b_Profile *profile) {
+  if (profile->entryCount == profile->entryCap) {
+    uint32_t newCap = profile->entryCap == 0
+                      ? PROFILE_MIN_ENTRIES
+                      : profile->entryCap * 2;
+    ProfileEntry *newEntries = (ProfileEntry*)realloc(
+      profile->entries, newCap * sizeof(ProfileEntry)
+    );
+    if (newEntries == NULL) {
+      return 0;
+    }
+    profile->entries = newEntries;
+    profile->entryCap = newCap;
+  }
+
+  if ((profile->entryCount + 1) * 2 > profile->bucketCount) {
+    uint32_t newCount = profile->bucketCount == 0
+                        ? PROFILE_MIN_ENTRIES * 2
+                        : profile->bucketCount * 2;
+    uint32_t *newBuckets = (uint32_t*)calloc(newCount, sizeof(uint32_t));
+    if (newBuckets == NULL) {
+      return 0;
+    }
+    for (uint32_t i = 0; i < profile->entryCount; i++) {
+      const ProfileEntry *entry = &profile->entries[i];
+      uint32_t idx = hashProfileKey(entry->nameIdx, entry->line)
+                     & (newCount - 1);
+      while (newBuckets[idx] != 0) {
+        idx = (idx + 1) & (newCount - 1);
+      }
+      newBuckets[idx] = i + 1;
+    }
+    free(profile->buckets);
+    profile->buckets = newBuckets;
+    profile->bucketCount = newCount;
+  }
+  return 1;
+}
+
+static _Bool growProfileNames(pl2b_Profile *profile) {
+  if (profile->nameCount == profile->nameCap) {
+    uint32_t newCap = profile->nameCap == 0
+                      ? PROFILE_MIN_ENTRIES
+                      : profile->nameCap * 2;
+    char **newNames =
+      (char**)realloc(profile->names, newCap * sizeof(char*));
+    if (newNames == NULL) {
+      return 0;
+    }
+    profile->names = newNames;
+    profile->nameCap = newCap;
+  }
+
+  if ((profile->nameCount + 1) * 2 > profile->nameBucketCount) {
+    uint32_t newCount = profile->nameBucketCount == 0
+                        ? PROFILE_MIN_ENTRIES * 2
+                        : profile->nameBucketCount * 2;
+    uint32_t *newBuckets = (uint32_t*)calloc(newCount, sizeof(uint32_t));
+    if (newBuckets == NULL) {
+      return 0;
+    }
+    for (uint32_t i = 0; i < profile->nameCount; i++) {
+      uint32_t idx = hashProfileName(profile->names[i]) & (newCount - 1);
+      while (newBuckets[idx] != 0) {
+        idx = (idx + 1) & (newCount - 1);
+      }
+      newBuckets[idx] = i + 1;
+    }
+    free(profile->nameBuckets);
+    profile->nameBuckets = newBuckets;
+    profile->nameBucketCount = newCount;
+  }
+  return 1;
+}
+
+static uint32_t hashProfileKey(uint32_t nameIdx, uint32_t line) {
+  uint64_t hash = ((uint64_t)nameIdx << 32 | line) * 0x9e3779b97f4a7c15ull;
+  return (uint32_t)(hash >> 32);
+}
+
+static uint32_t hashProfileName(const char *name) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (; *name != '\0'; name++) {
+    hash = (hash ^ (uint8_t)*name) * 0x100000001b3ull;
+  }
+  return (uint32_t)(hash ^ (hash >> 32));
+}
+
+/* nanoseconds per tick */
+static double profileScale(const pl2b_Profile *profile) {
+#ifdef PROFILE_TSC
+  uint64_t ticks = profileClock() - profile->startTicks;
+  uint64_t nanos = profileNanos() - profile->startNanos;
+  return ticks != 0 ? (double)nanos / (double)ticks : 1.0;
+#else
+  (void)profile;
+  return 1.0;
+#endif
+}
+
+/* sums up lines of each name, indexed by name */
+static ProfileEntry *profileByName(const pl2b_Profile *profile) {
+  ProfileEntry *ret =
+    (ProfileEntry*)calloc(profile->nameCount + 1, sizeof(ProfileEntry));
+  if (ret == NULL) {
+    return NULL;
+  }
+  for (uint32_t i = 0; i < profile->nameCount; i++) {
+    ret[i].nameIdx = i;
+  }
+  for (uint32_t i = 0; i < profile->entryCount; i++) {
+    const ProfileEntry *entry = &profile->entries[i];
+    sumProfileSlot(&ret[entry->nameIdx].slot, &entry->slot);
+  }
+  return ret;
+}
+
+/* pointers to `entries` by descending stub time */
+static const ProfileEntry **sortedEntries(const ProfileEntry *entries,
+                                          uint32_t count) {
+  const ProfileEntry **ret = (const ProfileEntry**)malloc(
+    (count + 1) * sizeof(const ProfileEntry*)
+  );
+  if (ret == NULL) {
+    return NULL;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    ret[i] = &entries[i];
+  }
+  qsort(ret, count, sizeof(const ProfileEntry*), cmpEntryByTime);
+  return ret;
+}
+
+static int cmpEntryByTime(const void *lhs, const void *rhs) {
+  const ProfileEntry *lhsEntry = *(const ProfileEntry* const*)lhs;
+  const ProfileEntry *rhsEntry = *(const ProfileEntry* const*)rhs;
+  if (lhsEntry->slot.stubTicks != rhsEntry->slot.stubTicks) {
+    return lhsEntry->slot.stubTicks > rhsEntry->slot.stubTicks ? -1 : 1;
+  }
+  /* entries come in order of first run */
+  return lhsEntry < rhsEntry ? -1 : lhsEntry > rhsEntry;
+}
+
+/* Times in integers, as formatting floats dominates long reports */
+static void writeReportLine(FILE *fp,
+                            const pl2b_Profile *profile,
+                            const ProfileEntry *entry,
+                            double scale) {
+  const ProfileSlot *slot = &entry->slot;
+  uint64_t total = (uint64_t)((double)slot->stubTicks * scale);
+  uint64_t dispatch = (uint64_t)((double)slot->dispatchTicks * scale);
+  fprintf(fp, "%12llu %8llu.%03llu %10llu %10llu %10llu %8llu.%03llu  %s",
+          (unsigned long long)slot->calls,
+          (unsigned long long)(total / 1000000),
+          (unsigned long long)(total / 1000 % 1000),
+          (unsigned long long)(slot->calls != 0 ? total / slot->calls : 0),
+          (unsigned long long)((double)slot->minTicks * scale),
+          (unsigned long long)((double)slot->maxTicks * scale),
+          (unsigned long long)(dispatch / 1000000),
+          (unsigned long long)(dispatch / 1000 % 1000),
+          profile->names[entry->nameIdx]);
+  if (entry->line != 0) {
+    fprintf(fp, ":%u\n", entry->line);
+  } else {
+    fputc('\n', fp);
+  }
+}
+
+/*** -------------------- Implementation of tracing ------------------ ***/
+
+/* Traced runs keep their last commands in a ring written by the run's
+   own thread only, in the way of a seqlock: the writer bumps `claimed`
+   before filling an entry and `head` after. Readers take entries below
+   `head` without any lock, and drop those `claimed` shows to have been
+   overwritten while reading. Rings are also listed in a fixed table
+   for signal handlers, which format by hand and write(2) only. A ring
+   leaving the table waits for dumps going on, so that handlers never
+   see it freed. Entries copy what they show of a command, as stubs may
+   free commands before the trace gets dumped, cutting names to
+   `TRACE_NAME_SIZE` bytes. */
+
+#define TRACE_MAX_SIZE  ((uint32_t)1 << 24)
+#define TRACE_MAX_RUNS  64
+#define TRACE_LINE_SIZE 256
+#define TRACE_NAME_WORDS 3
+#define TRACE_NAME_SIZE  (TRACE_NAME_WORDS * sizeof(uint64_t))
+
+#define TRACE_LOAD(obj) atomic_load_explicit(obj, memory_order_relaxed)
+#define TRACE_STORE(obj, value) \
+  atomic_store_explicit(obj, value, memory_order_relaxed)
+
+/* fields are atomic for readers on other threads only, and get
+   relaxed loads and stores, which are plain moves */
+typedef struct st_trace_entry {
+  _Atomic uint64_t name[TRACE_NAME_WORDS]; /* padded with NUL, unless
+                                              cut */
+  pl2b_PCallCmdStub *_Atomic stub; /* NULL for builtins, batches and
+                                      blocks */
+  _Atomic uint32_t line;
+  _Atomic uint32_t count;          /* commands run at once */
+  _Atomic uint64_t ticks;
+} TraceEntry;
+
+typedef struct st_trace_ring {
+  _Atomic uint64_t head;    /* entries ever written */
+  _Atomic uint64_t claimed; /* entries ever started to be written */
+  uint32_t mask;
+  uint64_t startTicks;
+  uint64_t startNanos;
+  TraceEntry entries[];
+} TraceRing;
+
+static uint32_t traceSize;
+static TraceRing *_Atomic traceRings[TRACE_MAX_RUNS];
+static _Atomic uint32_t traceDumping;
+
+static TraceRing *createTraceRing(void);
+static void dropTraceRing(TraceRing *ring);
+static inline void traceCommand(TraceRing *ring,
+                                const pl2b_Cmd *cmd,
+                                pl2b_PCallCmdStub *stub,
+                                uint32_t count);
+static void dumpTraceRing(TraceRing *ring, int fd);
+static void traceSignal(int signo);
+static size_t appendStr(char *buffer, size_t size, const char *str);
+static size_t appendUint(char *buffer, size_t size, uint64_t value);
+static size_t appendHex(char *buffer, size_t size, uintptr_t value);
+
+void pl2b_setTraceSize(uint32_t size) {
+  uint32_t rounded = 0;
+  if (size != 0) {
+    rounded = 1;
+    while (rounded < size && rounded < TRACE_MAX_SIZE) {
+      rounded *= 2;
+    }
+  }
+  traceSize = rounded;
+}
+
+_Bool pl2b_traceOnSignal(int signo) {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = traceSignal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  return sigaction(signo, &action, NULL) == 0;
+}
+
+/* NULL if tracing is off or out of memory */
+static TraceRing *createTraceRing(void) {
+  uint32_t size = traceSize;
+  if (size == 0) {
+    return NULL;
+  }
+  TraceRing *ret = (TraceRing*)malloc(sizeof(TraceRing)
+                                      + size * sizeof(TraceEntry));
+  if (ret == NULL) {
+    return NULL;
+  }
+  atomic_init(&ret->head, 0);
+  atomic_init(&ret->claimed, 0);
+  ret->mask = size - 1;
+  ret->startTicks = profileClock();
+  ret->startNanos = profileNanos();
+
+  for (uint32_t i = 0; i < TRACE_MAX_RUNS; i++) {
+    TraceRing *expected = NULL;
+    if (atomic_compare_exchange_strong(&traceRings[i], &expected, ret)) {
+      break;
+    }
+  }
+  return ret;
+}
+
+static void dropTraceRing(TraceRing *ring) {
+  for (uint32_t i = 0; i < TRACE_MAX_RUNS; i++) {
+    TraceRing *expected = ring;
+    if (atomic_compare_exchange_strong(&traceRings[i], &expected, NULL)) {
+      break;
+    }
+  }
+  while (atomic_load(&traceDumping) != 0) {
+    sched_yield();
+  }
+  free(ring);
+}
+
+static inline void traceCommand(TraceRing *ring,
+                                const pl2b_Cmd *cmd,
+                                pl2b_PCallCmdStub *stub,
+                                uint32_t count) {
+  uint64_t name[TRACE_NAME_WORDS] = { 0 };
+  if (cmd->cmd.len != 0) {
+    memcpy(name, cmd->cmd.str, cmd->cmd.len < TRACE_NAME_SIZE
+                               ? cmd->cmd.len
+                               : TRACE_NAME_SIZE);
+  }
+
+  uint64_t head = TRACE_LOAD(&ring->head);
+  TraceEntry *entry = &ring->entries[head & ring->mask];
+  TRACE_STORE(&ring->claimed, head + 1);
+  atomic_thread_fence(memory_order_release);
+  for (uint32_t i = 0; i < TRACE_NAME_WORDS; i++) {
+    TRACE_STORE(&entry->name[i], name[i]);
+  }
+  TRACE_STORE(&entry->stub, stub);
+  TRACE_STORE(&entry->line, cmd->sourceInfo.line);
+  TRACE_STORE(&entry->count, count);
+  TRACE_STORE(&entry->ticks, profileClock());
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/* Oldest first, with ages relative to now. Async-signal-safe. */
+static void dumpTraceRing(TraceRing *ring, int fd) {
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  uint64_t size = (uint64_t)ring->mask + 1;
+  uint64_t first = head > size ? head - size : 0;
+  uint64_t nowTicks = profileClock();
+  uint64_t nowNanos = profileNanos();
+  double scale = nowTicks != ring->startTicks
+                 ? (double)(nowNanos - ring->startNanos)
+                   / (double)(nowTicks - ring->startTicks)
+                 : 1.0;
+
+  char line[TRACE_LINE_SIZE];
+  size_t len = appendStr(line, sizeof(line), "pl2b trace: last ");
+  len += appendUint(line + len, sizeof(line) - len, head - first);
+  len += appendStr(line + len, sizeof(line) - len, " of ");
+  len += appendUint(line + len, sizeof(line) - len, head);
+  len += appendStr(line + len, sizeof(line) - len,
+                   " commands, oldest first\n");
+  ssize_t written = write(fd, line, len);
+
+  uint64_t dropped = 0;
+  for (uint64_t i = first; i < head; i++) {
+    TraceEntry *entry = &ring->entries[i & ring->mask];
+    /* one more word keeps cut names terminated */
+    uint64_t name[TRACE_NAME_WORDS + 1] = { 0 };
+    for (uint32_t j = 0; j < TRACE_NAME_WORDS; j++) {
+      name[j] = TRACE_LOAD(&entry->name[j]);
+    }
+    pl2b_PCallCmdStub *stub = TRACE_LOAD(&entry->stub);
+    uint32_t cmdLine = TRACE_LOAD(&entry->line);
+    uint32_t count = TRACE_LOAD(&entry->count);
+    uint64_t ticks = TRACE_LOAD(&entry->ticks);
+    atomic_thread_fence(memory_order_acquire);
+    if (TRACE_LOAD(&ring->claimed) > i + size) {
+      dropped++;
+      continue;
+    }
+
+    ticks = nowTicks >= ticks ? nowTicks - ticks : 0;
+    len = appendStr(line, sizeof(line), "  line ");
+    len += appendUint(line + len, sizeof(line) - len, cmdLine);
+    len += appendStr(line + len, sizeof(line) - len, "  ");
+    len += appendStr(line + len, sizeof(line) - len, (const char*)name);
+    if (count != 1) {
+      len += appendStr(line + len, sizeof(line) - len, " x");
+      len += appendUint(line + len, sizeof(line) - len, count);
+    }
+    if (stub != NULL) {
+      len += appendStr(line + len, sizeof(line) - len, "  stub ");
+      len += appendHex(line + len, sizeof(line) - len, (uintptr_t)stub);
+    }
+    len += appendStr(line + len, sizeof(line) - len, "  ");
+    len += appendUint(line + len, sizeof(line) - len,
+                      (uint64_t)((double)ticks * scale));
+    len += appendStr(line + len, sizeof(line) - len, " ns ago\n");
+    written = write(fd, line, len);
+  }
+  if (dropped != 0) {
+    len = appendStr(line, sizeof(line), "  (");
+    len += appendUint(line + len, sizeof(line) - len, dropped);
+    len += appendStr(line + len, sizeof(line) - len,
+                     " overwritten while dumping)\n");
+    written = write(fd, line, len);
+  }
+  (void)written;
+}
+
+static void traceSignal(int signo) {
+  (void)signo;
+
+  int savedErrno = errno;
+  atomic_fetch_add(&traceDumping, 1);
+  for (uint32_t i = 0; i < TRACE_MAX_RUNS; i++) {
+    TraceRing *ring = atomic_load(&traceRings[i]);
+    if (ring != NULL) {
+      dumpTraceRing(ring, STDERR_FILENO);
+    }
+  }
+  atomic_fetch_sub(&traceDumping, 1);
+  errno = savedErrno;
+}
+
+/* these append at most `size` chars, returning how many */
+static size_t appendStr(char *buffer, size_t size, const char *str) {
+  size_t len = 0;
+  for (; str[len] != '\0' && len < size; len++) {
+    buffer[len] = str[len];
+  }
+  return len;
+}
+
+static size_t appendUint(char *buffer, size_t size, uint64_t value) {
+  char digits[20];
+  size_t count = 0;
+  do {
+    digits[count++] = (char)('0' + value % 10);
+    value /= 10;
+  } while (value != 0);
+
+  size_t len = 0;
+  for (; count != 0 && len < size; len++) {
+    buffer[len] = digits[--count];
+  }
+  return len;
+}
+
+static size_t appendHex(char *buffer, size_t size, uintptr_t value) {
+  char digits[2 * sizeof(uintptr_t)];
+  size_t count = 0;
+  do {
+    digits[count++] = "0123456789abcdef"[value & 0xf];
+    value >>= 4;
+  } while (value != 0);
+
+  size_t len = appendStr(buffer, size, "0x");
+  for (; count != 0 && len < size; len++) {
+    buffer[len] = digits[--count];
+  }
+  return len;
+}
+
+/*** ----------------------------- Run ----------------------------- ***/
+
+/* Programs run as threaded code: an array of stub and command pairs,
+   laid out in program order by the link pass and terminated by an
+   empty record. A stub returning the command of the following record
+   continues the loop without any lookup; any other command is found
+   through its binding, which holds a record index. Builtins have no
+   stub and leave the fast path, and so do records starting a run of
+   commands that goes to a batch stub. Runs are detected by the link
+   pass, and entering a run anywhere batches the rest of it.
+
+   A run suspended through pl2b_waitFd or pl2b_waitTimer returns from
+   the loop, and resumes from `curCmd` through its binding. So does a
+   run out of its step budget, which is counted down per command and
+   only checked against the clock every RUN_CLOCK_STEPS commands.
+
+   A `?parallel` block of two or more thread-safe commands has its
+   first record turned into a builtin-like one, keeping its entry, and
+   entering there runs the whole block on the block pool. The first
+   error in program order wins, and so does the first jump; otherwise
+   the run continues behind the block. Entering elsewhere, or any block
+   with other commands, runs sequentially.
+
+   The loop is instantiated with profiling and tracing compiled in or
+   out, so that runs without them do not pay for it. Profiled runs take
+   the clock right before and after each stub, charging time between
+   stubs to the dispatch of the following command. Traced runs record
+   each stub call, batch and block before making it, so that the
+   command failing or hanging comes last. */
+
+#if defined(__GNUC__)
+#define RUN_PREFETCH(addr) __builtin_prefetch(addr)
+#define RUN_INLINE         inline __attribute__((always_inline))
+#else
+#define RUN_PREFETCH(addr) ((void)(addr))
+#define RUN_INLINE         inline
+#endif
+
+#define RUN_CODE_MIN_SIZE 64
+#define RUN_CLOCK_STEPS   256
+#define RUN_NO_LIMIT      UINT64_MAX
+
+typedef pl2b_RunContext RunContext;
+
+#define RUN_MIN_BINDINGS 64
+
+typedef struct st_cmd_binding {
+  const pl2b_Cmd *cmd;  /* NULL for empty bucket */
+  uint64_t cmdId;       /* tells `cmd` from commands reusing its memory */
+  uint32_t recordIdx;   /* record index plus one, or 0 if unbound */
+  void *extra;
+} CmdBinding;
+
+typedef struct st_threaded_record {
+  pl2b_PCallCmdStub *stub; /* NULL for builtins, batch runs and
+                              parallel blocks */
+  pl2b_Cmd *cmd;
+  uint64_t cmdId;          /* `cmd` may be freed, and its memory reused */
+  uint32_t entryIdx;
+  uint32_t batchLen;       /* commands left in run, counting this one,
+                              0 for builtins and parallel blocks */
+} ThreadedRecord;
+
+struct st_pl2b_run_context {
+  pl2b_Program *program;
+  void *userContext;
+
+  LanguageModule *module;
+  pl2b_Language *language;   /* shared with `module` */
+  DispatchTable *dispatch;
+
+  ThreadedRecord *code; /* `codeSize` records and an empty record */
+  uint32_t codeSize;
+  uint32_t codeCap;
+
+  /* bindings of this run, as the program itself is never written to:
+     dense commands are indexed, others hashed by address and checked by
+     id */
+  uint32_t *denseRecords; /* record index plus one, or 0 if unbound */
+  void **denseExtras;
+  CmdBinding *bindings;
+  size_t bindingCount;
+  size_t bindingCap;
+
+  pl2b_Cmd *curCmd;     /* where to start or resume */
+  _Bool finished;
+  _Bool inParallel;     /* running a `?parallel` block */
+  pl2b_Profile *profile;
+  ProfileSlot *profSlots; /* one per record, if profiling */
+  ProfileKey *profKeys;   /* as many as `profSlots` */
+  uint32_t profSlotCap;
+  uint32_t profKeyCount;  /* records keyed so far */
+  TraceRing *trace;     /* NULL if not tracing */
+  uint64_t stepLimit;   /* commands to run until yielding */
+  uint64_t timeLimit;   /* clock deadline of yielding, or 0 */
+
+  /* only used by runs on a scheduler */
+  pl2b_Scheduler *scheduler;
+  pl2b_Error *error;
+  pl2b_RunDone *done;
+  void *doneArg;
+  uint32_t waitKind;
+  int waitFd;
+  int waitDup;          /* `waitFd` duplicate registered to epoll */
+  uint32_t waitEvents;
+  pl2b_Cmd *waitCmd;    /* command that suspended the run */
+  uint64_t deadline;
+  struct st_pl2b_run_context *nextReady;
+  struct st_pl2b_run_context *prevLive;
+  struct st_pl2b_run_context *nextLive;
+};
+
+typedef enum e_run_state {
+  RUN_FINISHED  = PL2B_RUN_FINISHED,
+  RUN_YIELDED   = PL2B_RUN_YIELDED,
+  RUN_SUSPENDED
+} RunState;
+
+typedef enum e_run_wait {
+  RUN_WAIT_NONE,
+  RUN_WAIT_FD,
+  RUN_WAIT_TIMER
+} RunWait;
+
+/* run of which stubs are being called on this thread */
+static _Thread_local RunContext *activeRun;
+/* returned to the loop by stubs of a suspending run */
+static pl2b_Cmd pendingCmd;
+
+static RunContext *createRunContext(pl2b_Program *program);
+static void destroyRunContext(RunContext *context);
+static RunState runThreaded(RunContext *context, pl2b_Error *error);
+static RUN_INLINE RunState runLoopWith(RunContext *context,
+                                       pl2b_Error *error,
+                                       const _Bool profiled,
+                                       const _Bool traced);
+static RunState runLoop(RunContext *context, pl2b_Error *error);
+static RunState runLoopTraced(RunContext *context, pl2b_Error *error);
+static RunState runLoopProfiled(RunContext *context, pl2b_Error *error);
+static RUN_INLINE void profileDispatch(RunContext *context,
+                                       uint32_t recIdx,
+                                       uint32_t count,
+                                       uint64_t mark);
+static RUN_INLINE void profileStub(RunContext *context,
+                                   uint32_t recIdx,
+                                   uint32_t count,
+                                   uint64_t *mark);
+static _Bool reserveProfileSlots(RunContext *context);
+static void keyProfileSlots(RunContext *context);
+static void addRunProfile(RunContext *context);
+static void dumpTraceOnError(RunContext *context, pl2b_Error *error);
+static uint64_t runSlice(RunContext *context, uint64_t stepsLeft);
+static ThreadedRecord *recordOf(RunContext *context,
+                                pl2b_Cmd *cmd,
+                                pl2b_Error *error);
+static _Bool emitRecord(RunContext *context,
+                        pl2b_Cmd *cmd,
+                        uint32_t entryIdx,
+                        pl2b_Error *error);
+static pl2b_Cmd *skipStub(pl2b_Program *program,
+                          void *context,
+                          pl2b_Cmd *cmd,
+                          pl2b_Error *error);
+static void markBatchRuns(RunContext *context, uint32_t start);
+static void markParallelBlocks(RunContext *context, uint32_t start);
+static uint32_t blockLength(const ThreadedRecord *head);
+static void runBlockTask(void *arg, uint32_t idx);
+static pl2b_Cmd *runBlock(RunContext *context,
+                          ThreadedRecord *head,
+                          uint32_t count,
+                          pl2b_Error *error);
+static _Bool isSameCmd(const pl2b_Cmd *cmd1, const pl2b_Cmd *cmd2);
+static _Bool loadLanguage(RunContext *context,
+                          pl2b_Cmd *cmd,
+                          pl2b_Error *error);
+static uint32_t resolveEntry(RunContext *context, const pl2b_Cmd *cmd);
+static uint32_t bindCmd(RunContext *context,
+                        pl2b_Cmd *cmd,
+                        pl2b_Error *error);
+static _Bool linkProgram(RunContext *context, pl2b_Error *error);
+static uint32_t *recordSlot(RunContext *context,
+                            const pl2b_Cmd *cmd,
+                            _Bool create);
+static void **extraSlot(RunContext *context,
+                        const pl2b_Cmd *cmd,
+                        _Bool create);
+static CmdBinding *hashedBinding(RunContext *context,
+                                 const pl2b_Cmd *cmd,
+                                 _Bool create);
+static _Bool growBindings(RunContext *context);
+static void cleanupExtras(RunContext *context);
+static uint64_t monotonicNanos(void);
+
+void pl2b_run(pl2b_Program *program, pl2b_Error *error) {
+  RunContext *context = createRunContext(program);
+  if (context == NULL) {
+    pl2b_errPrintf(error, PL2B_ERR_MALLOC, pl2b_sourceInfo(NULL, 0),
+                   NULL, "run: cannot allocate memory for run context");
+    return;
+  }
+
+  runThreaded(context, error);
+  dumpTraceOnError(context, error);
+  destroyRunContext(context);
+}
+
+void pl2b_runProfiled(pl2b_Program *program,
+                      pl2b_Profile *profile,
+                      pl2b_Error *error) {
+  RunContext *context = createRunContext(program);
+  if (context == NULL) {
+    pl2b_errPrintf(error, PL2B_ERR_MALLOC, pl2b_sourceInfo(NULL, 0),
+                   NULL, "run: cannot allocate memory for run context");
+    return;
+  }
+
+  context->profile = profile;
+  runThreaded(context, error);
+  dumpTraceOnError(context, error);
+  destroyRunContext(context);
+}
+
+pl2b_RunContext *pl2b_runStart(pl2b_Program *program,
+                               pl2b_Error *error) {
+  RunContext *context = createRunContext(program);
+  if (context == NULL) {
+    pl2b_errPrintf(error, PL2B_ERR_MALLOC, pl2b_sourceInfo(NULL, 0),
+                   NULL, "run: cannot allocate memory for run context");
+  }
+  return context;
+}
+
+pl2b_RunStatus pl2b_runSteps(pl2b_RunContext *context,
+                             uint64_t maxSteps,
+                             uint64_t nanos,
+                             pl2b_Error *error) {
+  if (context->finished) {
+    return PL2B_RUN_FINISHED;
+  }
+
+  context->stepLimit = maxSteps != 0 ? maxSteps : RUN_NO_LIMIT;
+  context->timeLimit = nanos != 0 ? monotonicNanos() + nanos : 0;
+  RunState state = runThreaded(context, error);
+  context->stepLimit = RUN_NO_LIMIT;
+  context->timeLimit = 0;
+  if (state == RUN_FINISHED) {
+    context->finished = 1;
+    dumpTraceOnError(context, error);
+    return PL2B_RUN_FINISHED;
+  }
+  return PL2B_RUN_YIELDED;
+}
+
+void pl2b_runFinish(pl2b_RunContext *context) {
+  destroyRunContext(context);
+}
+
+void pl2b_runProfile(pl2b_RunContext *context, pl2b_Profile *profile) {
+  context->profile = profile;
+}
+
+void pl2b_dumpTrace(pl2b_RunContext *context, int fd) {
+  if (context->trace != NULL) {
+    dumpTraceRing(context->trace, fd);
+  }
+}
+
+pl2b_Cmd *pl2b_waitFd(pl2b_Program *program,
+                      int fd,
+                      uint32_t events,
+                      pl2b_Cmd *resume) {
+  RunContext *context = activeRun;
+  if (context == NULL
+      || context->scheduler == NULL
+      || context->inParallel
+      || context->program != program) {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = (short)(((events & PL2B_WAIT_READ) ? POLLIN : 0)
+                         | ((events & PL2B_WAIT_WRITE) ? POLLOUT : 0));
+    while (poll(&pfd, 1, -1) < 0 && errno == EINTR) {}
+    return resume;
+  }
+
+  context->waitKind = RUN_WAIT_FD;
+  context->waitFd = fd;
+  context->waitEvents = events;
+  context->curCmd = resume;
+  return &pendingCmd;
+}
+
+pl2b_Cmd *pl2b_waitTimer(pl2b_Program *program,
+                         uint64_t nanos,
+                         pl2b_Cmd *resume) {
+  RunContext *context = activeRun;
+  if (context == NULL
+      || context->scheduler == NULL
+      || context->inParallel
+      || context->program != program) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)(nanos / 1000000000);
+    ts.tv_nsec = (long)(nanos % 1000000000);
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {}
+    return resume;
+  }
+
+  context->waitKind = RUN_WAIT_TIMER;
+  context->deadline = monotonicNanos() + nanos;
+  context->curCmd = resume;
+  return &pendingCmd;
+}
+
+void **pl2b_cmdExtraSlot(pl2b_Program *program, pl2b_Cmd *cmd) {
+  RunContext *context = activeRun;
+  if (context == NULL || context->program != program) {
+    return NULL;
+  }
+  return extraSlot(context, cmd, !context->inParallel);
+}
+
+/* NULL if `cmd` was never bound and `create` is not set, or if out of
+   memory */
+static uint32_t *recordSlot(RunContext *context,
+                            const pl2b_Cmd *cmd,
+                            _Bool create) {
+  const pl2b_Program *program = context->program;
+  if (cmd >= program->commands
+      && cmd < program->commands + program->cmdCount) {
+    if (context->denseRecords == NULL) {
+      if (!create) {
+        return NULL;
+      }
+      context->denseRecords =
+        (uint32_t*)calloc(program->cmdCount, sizeof(uint32_t));
+      if (context->denseRecords == NULL) {
+        return NULL;
+      }
+    }
+    return &context->denseRecords[cmd - program->commands];
+  }
+
+  CmdBinding *binding = hashedBinding(context, cmd, create);
+  return binding != NULL ? &binding->recordIdx : NULL;
+}
+
+static void **extraSlot(RunContext *context,
+                        const pl2b_Cmd *cmd,
+                        _Bool create) {
+  const pl2b_Program *program = context->program;
+  if (cmd >= program->commands
+      && cmd < program->commands + program->cmdCount) {
+    if (context->denseExtras == NULL) {
+      if (!create) {
+        return NULL;
+      }
+      context->denseExtras =
+        (void**)calloc(program->cmdCount, sizeof(void*));
+      if (context->denseExtras == NULL) {
+        return NULL;
+      }
+    }
+    return &context->denseExtras[cmd - program->commands];
+  }
+
+  CmdBinding *binding = hashedBinding(context, cmd, create);
+  return binding != NULL ? &binding->extra : NULL;
+}
+
+static CmdBinding *hashedBinding(RunContext *context,
+                                 const pl2b_Cmd *cmd,
+                                 _Bool create) {
+  if (create && (context->bindingCount + 1) * 2 > context->bindingCap
+      && !growBindings(context)) {
+    return NULL;
+  }
+  if (context->bindingCap == 0) {
+    return NULL;
+  }
+
+  size_t mask = context->bindingCap - 1;
+  size_t idx = (size_t)(((uintptr_t)cmd >> 4) * 0x9e3779b97f4a7c15ull)
+               & mask;
+  while (context->bindings[idx].cmd != NULL) {
+    CmdBinding *binding = &context->bindings[idx];
+    if (binding->cmd == cmd) {
+      if (binding->cmdId == cmd->id) {
+        return binding;
+      }
+      /* a stub freed the bound command, and `cmd` took its memory */
+      if (!create) {
+        return NULL;
+      }
+      if (binding->extra != NULL && context->language != NULL
+          && context->language->cmdCleanup != NULL) {
+        context->language->cmdCleanup(binding->extra);
+      }
+      binding->cmdId = cmd->id;
+      binding->recordIdx = 0;
+      binding->extra = NULL;
+      return binding;
+    }
+    idx = (idx + 1) & mask;
+  }
+  if (!create) {
+    return NULL;
+  }
+
+  context->bindings[idx].cmd = cmd;
+  context->bindings[idx].cmdId = cmd->id;
+  context->bindingCount++;
+  return &context->bindings[idx];
+}
+
+static _Bool growBindings(RunContext *context) {
+  size_t newCap = context->bindingCap != 0
+                  ? context->bindingCap * 2
+                  : RUN_MIN_BINDINGS;
+  CmdBinding *newBindings = (CmdBinding*)calloc(newCap, sizeof(CmdBinding));
+  if (newBindings == NULL) {
+    return 0;
+  }
+
+  for (size_t i = 0; i < context->bindingCap; i++) {
+    const CmdBinding *binding = &context->bindings[i];
+    if (binding->cmd == NULL) {
+      continue;
+    }
+    size_t idx = (size_t)(((uintptr_t)binding->cmd >> 4)
+                          * 0x9e3779b97f4a7c15ull)
+                 & (newCap - 1);
+    while (newBindings[idx].cmd != NULL) {
+      idx = (idx + 1) & (newCap - 1);
+    }
+    newBindings[idx] = *binding;
+  }
+  free(context->bindings);
+  context->bindings = newBindings;
+  context->bindingCap = newCap;
+  return 1;
+}
+
+static void cleanupExtras(RunContext *context) {
+  pl2b_CmdCleanupStub *cleanup = context->language->cmdCleanup;
+  if (context->denseExtras != NULL) {
+    for (size_t i = 0; i < context->program->cmdCount; i++) {
+      if (context->denseExtras[i] != NULL) {
+        cleanup(context->denseExtras[i]);
+      }
+    }
+  }
+  for (size_t i = 0; i < context->bindingCap; i++) {
+    if (context->bindings[i].extra != NULL) {
+      cleanup(context->bindings[i].extra);
+    }
+  }
+}
+
+/* commands to run until next check, only checking the clock as often
+   as RUN_CLOCK_STEPS if there is a time limit */
+static uint64_t runSlice(RunContext *context, uint64_t stepsLeft) {
+  if (context->timeLimit != 0 && stepsLeft > RUN_CLOCK_STEPS) {
+    return RUN_CLOCK_STEPS;
+  }
+  return stepsLeft;
+}
+
+/* Samples time since `mark` as dispatch of `count` records from
+   `recIdx`, leaving the clock to the stub on all other calls */
+static RUN_INLINE void profileDispatch(RunContext *context,
+                                       uint32_t recIdx,
+                                       uint32_t count,
+                                       uint64_t mark) {
+  if (context->profSlots[recIdx].calls % PROFILE_DISPATCH_SAMPLE != 0) {
+    return;
+  }
+  uint64_t ticks = (profileClock() - mark) / count;
+  for (uint32_t i = 0; i < count; i++) {
+    context->profSlots[recIdx + i].dispatchTicks += ticks;
+    context->profSlots[recIdx + i].dispatchSamples++;
+  }
+}
+
+/* charges time since `*mark` evenly to stubs of `count` records */
+static RUN_INLINE void profileStub(RunContext *context,
+                                   uint32_t recIdx,
+                                   uint32_t count,
+                                   uint64_t *mark) {
+  uint64_t now = profileClock();
+  uint64_t ticks = (now - *mark) / count;
+  for (uint32_t i = 0; i < count; i++) {
+    addProfileTicks(&context->profSlots[recIdx + i], ticks);
+  }
+  *mark = now;
+}
+
+/* keeps a zeroed slot and a key for every record the code has room
+   for */
+static _Bool reserveProfileSlots(RunContext *context) {
+  if (context->profSlotCap >= context->codeCap) {
+    return 1;
+  }
+  ProfileSlot *newSlots = (ProfileSlot*)realloc(
+    context->profSlots, context->codeCap * sizeof(ProfileSlot)
+  );
+  if (newSlots == NULL) {
+    return 0;
+  }
+  context->profSlots = newSlots;
+  ProfileKey *newKeys = (ProfileKey*)realloc(
+    context->profKeys, context->codeCap * sizeof(ProfileKey)
+  );
+  if (newKeys == NULL) {
+    return 0;
+  }
+  context->profKeys = newKeys;
+  memset(newSlots + context->profSlotCap, 0,
+         (context->codeCap - context->profSlotCap) * sizeof(ProfileSlot));
+  context->profSlotCap = context->codeCap;
+  return 1;
+}
+
+/* Keys records emitted since the last call, whose commands are alive:
+   those linked together, one bound while running or those emitted
+   before a late pl2b_runProfile */
+static void keyProfileSlots(RunContext *context) {
+  pl2b_Profile *profile = context->profile;
+  if (profile == NULL || context->profKeyCount >= context->codeSize) {
+    return;
+  }
+  /* neighbouring records mostly share their name */
+  const char *lastName = NULL;
+  uint32_t nameIdx = UINT32_MAX;
+  pthread_mutex_lock(&profile->lock);
+  for (uint32_t i = context->profKeyCount;
+       i < context->codeSize && i < context->profSlotCap;
+       i++) {
+    const pl2b_Cmd *cmd = context->code[i].cmd;
+    if (lastName == NULL || strcmp(lastName, cmd->cmd.str) != 0) {
+      lastName = cmd->cmd.str;
+      nameIdx = internProfileName(profile, lastName);
+    }
+    context->profKeys[i].nameIdx = nameIdx;
+    context->profKeys[i].line = cmd->sourceInfo.line;
+    context->profKeyCount = i + 1;
+  }
+  pthread_mutex_unlock(&profile->lock);
+}
+
+/* reads no command, as stubs may have freed some */
+static void addRunProfile(RunContext *context) {
+  pl2b_Profile *profile = context->profile;
+  pthread_mutex_lock(&profile->lock);
+  for (uint32_t i = 0; i < context->profKeyCount; i++) {
+    ProfileSlot slot = context->profSlots[i];
+    const ProfileKey *key = &context->profKeys[i];
+    if (slot.calls == 0 || key->nameIdx == UINT32_MAX) {
+      continue;
+    }
+    estimateDispatch(&slot);
+    if (!addProfileSlot(profile, key->nameIdx, key->line, &slot)) {
+      break;
+    }
+  }
+  pthread_mutex_unlock(&profile->lock);
+}
+
+static void dumpTraceOnError(RunContext *context, pl2b_Error *error) {
+  if (context->trace != NULL && pl2b_isError(error)) {
+    dumpTraceRing(context->trace, STDERR_FILENO);
+  }
+}
+
+static uint64_t monotonicNanos(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static RunContext *createRunContext(pl2b_Program *program) {
+  RunContext *context = (RunContext*)malloc(sizeof(RunContext));
+  if (context == NULL) {
+    return NULL;
+  }
+
+  context->program = program;
+  context->userContext = NULL;
+  context->module = NULL;
+  context->language = NULL;
+  context->dispatch = NULL;
+  context->code = NULL;
+  context->codeSize = 0;
+  context->codeCap = 0;
+  context->denseRecords = NULL;
+  context->denseExtras = NULL;
+  context->bindings = NULL;
+  context->bindingCount = 0;
+  context->bindingCap = 0;
+  context->curCmd = program->commands;
+  context->finished = 0;
+  context->inParallel = 0;
+  context->profile = NULL;
+  context->profSlots = NULL;
+  context->profKeys = NULL;
+  context->profSlotCap = 0;
+  context->profKeyCount = 0;
+  context->trace = createTraceRing();
+  context->stepLimit = RUN_NO_LIMIT;
+  context->timeLimit = 0;
+  context->scheduler = NULL;
+  context->error = NULL;
+  context->done = NULL;
+  context->doneArg = NULL;
+  context->waitKind = RUN_WAIT_NONE;
+  context->waitFd = -1;
+  context->waitDup = -1;
+  context->waitEvents = 0;
+  context->waitCmd = NULL;
+  context->deadline = 0;
+  context->nextReady = NULL;
+  context->prevLive = NULL;
+  context->nextLive = NULL;
+  return context;
+}
+
+static void destroyRunContext(RunContext *context) {
+  if (context->profile != NULL) {
+    addRunProfile(context);
+  }
+  if (context->trace != NULL) {
+    dropTraceRing(context->trace);
+  }
+  free(context->profSlots);
+  free(context->profKeys);
+  free(context->code);
+  if (context->module != NULL) {
+    if (context->language != NULL) {
+      if (context->language->atExit != NULL) {
+        context->language->atExit(context->userContext);
+      }
+      if (context->language->cmdCleanup != NULL) {
+        cleanupExtras(context);
+      }
+      context->language = NULL;
+    }
+    releaseModule(context->module);
+  }
+  free(context->denseRecords);
+  free(context->denseExtras);
+  free(context->bindings);
+  free(context);
+}
+
+static RunState runThreaded(RunContext *context, pl2b_Error *error) {
+  RunContext *outer = activeRun;
+  activeRun = context;
+  RunState ret;
+  if (context->profile != NULL && !reserveProfileSlots(context)) {
+    pl2b_errPrintf(error, PL2B_ERR_MALLOC, pl2b_sourceInfo(NULL, 0),
+                   NULL, "run: cannot allocate memory for profiling");
+    ret = RUN_FINISHED;
+  } else if (context->profile != NULL) {
+    keyProfileSlots(context);
+    ret = runLoopProfiled(context, error);
+  } else if (context->trace != NULL) {
+    ret = runLoopTraced(context, error);
+  } else {
+    ret = runLoop(context, error);
+  }
+  activeRun = outer;
+  return ret;
+}
+
+static RunState runLoop(RunContext *context, pl2b_Error *error) {
+  return runLoopWith(context, error, 0, 0);
+}
+
+static RunState runLoopTraced(RunContext *context, pl2b_Error *error) {
+  return runLoopWith(context, error, 0, 1);
+}
+
+/* profiling costs much more than checking for a trace */
+static RunState runLoopProfiled(RunContext *context, pl2b_Error *error) {
+  return runLoopWith(context, error, 1, context->trace != NULL);
+}
+
+static RUN_INLINE RunState runLoopWith(RunContext *context,
+                                       pl2b_Error *error,
+                                       const _Bool profiled,
+                                       const _Bool traced) {
+  pl2b_Program *program = context->program;
+  pl2b_Cmd *cmd = context->curCmd;
+  ThreadedRecord *rec = NULL;
+  /* `budget` of the current slice of `stepsLeft` remains */
+  uint64_t stepsLeft = context->stepLimit;
+  uint64_t slice = runSlice(context, stepsLeft);
+  uint64_t budget = slice;
+  /* clock at the end of the last stub */
+  uint64_t mark = profiled ? profileClock() : 0;
+
+  while (1) {
+    if (rec == NULL) {
+      if (cmd == NULL) {
+        return RUN_FINISHED;
+      }
+      if (isLazyError(program, cmd)) {
+        takeLazyError(program, error);
+        return RUN_FINISHED;
+      }
+      if (cmd == &pendingCmd) {
+        return RUN_SUSPENDED;
+      }
+      rec = recordOf(context, cmd, error);
+      if (rec == NULL) {
+        return RUN_FINISHED;
+      }
+    }
+    if (budget == 0) {
+      stepsLeft -= slice;
+      if (stepsLeft == 0
+          || (context->timeLimit != 0
+              && monotonicNanos() >= context->timeLimit)) {
+        context->curCmd = rec->cmd;
+        return RUN_YIELDED;
+      }
+      slice = runSlice(context, stepsLeft);
+      budget = slice;
+    }
+    if (program->lazy != NULL) {
+      /* keeps `cmd->next` available to the stub */
+      lazyParseNext(program, rec->cmd);
+    }
+
+    if (rec->stub == NULL && rec->batchLen != 0) {
+      /* a run longer than the budget is split */
+      uint32_t count = rec->batchLen <= budget
+                       ? rec->batchLen
+                       : (uint32_t)budget;
+      budget -= count;
+      ThreadedRecord *last = rec + count - 1;
+      if (program->lazy != NULL) {
+        lazyParseNext(program, last->cmd);
+      }
+      pl2b_PCallBatchStub *batchStub =
+        context->dispatch->entries[rec->entryIdx].pCallCmd->batchStub;
+      uint32_t recIdx = (uint32_t)(rec - context->code);
+      if (traced) {
+        traceCommand(context->trace, rec->cmd, NULL, count);
+      }
+      if (profiled) {
+        profileDispatch(context, recIdx, count, mark);
+      }
+      /* the stub may drop its commands, so probes read them before */
+      const char *name = rec->cmd->cmd.str;
+      uint32_t line = rec->cmd->sourceInfo.line;
+      PROBE3(batch_entry, name, line, count);
+      pl2b_Cmd *next = batchStub(program, context->userContext,
+                                 rec->cmd, count, error);
+      PROBE3(batch_return, name, line, count);
+      if (profiled) {
+        profileStub(context, recIdx, count, &mark);
+      }
+      if (pl2b_isError(error)) {
+        return RUN_FINISHED;
+      }
+      if (next == last[1].cmd && next != NULL
+          && next->id == last[1].cmdId) {
+        rec = last + 1;
+      } else {
+        if (next == &pendingCmd) {
+          context->waitCmd = rec->cmd;
+        }
+        cmd = next;
+        rec = NULL;
+      }
+      continue;
+    }
+
+    budget--;
+    if (rec->stub == NULL && rec->entryIdx >= DISPATCH_FIRST) {
+      /* a block runs as a whole, counting each of its commands */
+      uint32_t count = blockLength(rec);
+      budget -= count - 1 <= budget ? count - 1 : budget;
+      if (traced) {
+        traceCommand(context->trace, rec->cmd, NULL, count);
+      }
+      uint32_t recIdx = (uint32_t)(rec - context->code);
+      uint64_t dispatchTicks = profiled ? profileClock() - mark : 0;
+      cmd = runBlock(context, rec, count, error);
+      if (profiled) {
+        /* tasks time themselves, so dispatch is measured on every call
+           and charged to the head like to any stub */
+        ProfileSlot *slot = &context->profSlots[recIdx];
+        slot->stubTicks += dispatchTicks;
+        slot->dispatchTicks += dispatchTicks;
+        slot->dispatchSamples++;
+        mark = profileClock();
+      }
+      if (pl2b_isError(error)) {
+        return RUN_FINISHED;
+      }
+      rec = NULL;
+      continue;
+    }
+    if (rec->stub == NULL) {
+      if (resolveBuiltin(rec->cmd) == DISPATCH_ABORT) {
+        return RUN_FINISHED;
+      }
+      /* linking rebuilds the code, so continue through the binding */
+      cmd = rec->cmd;
+      uint32_t recIdx = (uint32_t)(rec - context->code);
+      if (traced) {
+        traceCommand(context->trace, cmd, NULL, 1);
+      }
+      if (profiled) {
+        profileDispatch(context, recIdx, 1, mark);
+      }
+      _Bool loaded = loadLanguage(context, cmd, error);
+      if (profiled) {
+        profileStub(context, recIdx, 1, &mark);
+      }
+      if (!loaded) {
+        return RUN_FINISHED;
+      }
+      cmd = cmd->next;
+      rec = NULL;
+      continue;
+    }
+
+    RUN_PREFETCH(rec[1].cmd);
+    if (traced) {
+      traceCommand(context->trace, rec->cmd, rec->stub, 1);
+    }
+    if (profiled) {
+      profileDispatch(context, (uint32_t)(rec - context->code), 1, mark);
+    }
+    const char *name = rec->cmd->cmd.str;
+    uint32_t line = rec->cmd->sourceInfo.line;
+    PROBE2(cmd_entry, name, line);
+    pl2b_Cmd *next =
+      rec->stub(program, context->userContext, rec->cmd, error);
+    PROBE2(cmd_return, name, line);
+    if (profiled) {
+      profileStub(context, (uint32_t)(rec - context->code), 1, &mark);
+    }
+    if (pl2b_isError(error)) {
+      return RUN_FINISHED;
+    }
+    if (next == rec[1].cmd && next != NULL
+        && next->id == rec[1].cmdId) {
+      rec++;
+    } else {
+      if (next == &pendingCmd) {
+        context->waitCmd = rec->cmd;
+      }
+      cmd = next;
+      rec = NULL;
+    }
+  }
+}
+
+/* Finds the record of `cmd`, binding it if the link pass has not seen
+   it: commands run before the language gets loaded, parsed lazily
+   afterwards or created by stubs. */
+static ThreadedRecord *recordOf(RunContext *context,
+                                pl2b_Cmd *cmd,
+                                pl2b_Error *error) {
+  uint32_t *slot = recordSlot(context, cmd, 0);
+  if (slot != NULL && *slot != 0) {
+    return &context->code[*slot - 1];
+  }
+
+  uint32_t idx = bindCmd(context, cmd, error);
+  if (pl2b_isError(error)) {
+    return NULL;
+  }
+  keyProfileSlots(context);
+  if (idx == DISPATCH_UNBOUND) {
+    if (context->dispatch == NULL) {
+      pl2b_errPrintf(error, PL2B_ERR_NO_LANG, cmd->sourceInfo, NULL,
+                     "no language loaded to execute user command");
+    } else {
+      pl2b_errPrintf(error, PL2B_ERR_UNKNOWN_CMD, cmd->sourceInfo, NULL,
+                     "`%s` is not recognized as an internal or external "
+                     "command, operable program or batch file",
+                     cmd->cmd.str);
+    }
+    return NULL;
+  }
+
+  const pl2b_PCallCmd *pCallCmd = idx >= DISPATCH_FIRST
+                                  ? context->dispatch->entries[idx].pCallCmd
+                                  : NULL;
+  if (pCallCmd != NULL && pCallCmd->removed) {
+    pl2b_errPrintf(error, PL2B_ERR_REMOVED_CMD, cmd->sourceInfo, NULL,
+                   "`%s` has been removed from the language",
+                   cmd->cmd.str);
+    return NULL;
+  }
+  if (pCallCmd != NULL && pCallCmd->deprecated) {
+    fprintf(stderr, "[int/w] using deprecated command: %s\n",
+            cmd->cmd.str);
+  }
+  if (pCallCmd != NULL && pCallCmd->stub == NULL
+      && pCallCmd->batchStub == NULL) {
+    fprintf(stderr,
+            "[int/w] entry for command %s exists but NULL\n",
+            cmd->cmd.str);
+  }
+  return &context->code[*recordSlot(context, cmd, 0) - 1];
+}
+
+/* appends a record for `cmd` and binds `cmd` to it */
+static _Bool emitRecord(RunContext *context,
+                        pl2b_Cmd *cmd,
+                        uint32_t entryIdx,
+                        pl2b_Error *error) {
+  if (context->codeSize + 1 >= context->codeCap) {
+    uint32_t newCap = context->codeCap == 0
+                      ? RUN_CODE_MIN_SIZE
+                      : context->codeCap * 2;
+    if (newCap < context->codeCap) {
+      pl2b_errPrintf(error, PL2B_ERR_MALLOC, cmd->sourceInfo, NULL,
+                     "run: too many commands");
+      return 0;
+    }
+    ThreadedRecord *newCode = (ThreadedRecord*)realloc(
+      context->code, newCap * sizeof(ThreadedRecord)
+    );
+    if (newCode == NULL) {
+      pl2b_errPrintf(error, PL2B_ERR_MALLOC, cmd->sourceInfo, NULL,
+                     "run: cannot allocate memory for threaded code");
+      return 0;
+    }
+    context->code = newCode;
+    context->codeCap = newCap;
+    if (context->profile != NULL && !reserveProfileSlots(context)) {
+      pl2b_errPrintf(error, PL2B_ERR_MALLOC, cmd->sourceInfo, NULL,
+                     "run: cannot allocate memory for profiling");
+      return 0;
+    }
+  }
+
+  ThreadedRecord *rec = &context->code[context->codeSize];
+  rec->cmd = cmd;
+  rec->cmdId = cmd->id;
+  rec->entryIdx = entryIdx;
+  if (entryIdx == DISPATCH_LANGUAGE || entryIdx == DISPATCH_ABORT) {
+    rec->stub = NULL;
+    rec->batchLen = 0;
+  } else {
+    const DispatchEntry *entry = &context->dispatch->entries[entryIdx];
+    rec->stub = entry->stub;
+    rec->batchLen = 1;
+    if (rec->stub == NULL
+        && (entry->pCallCmd == NULL || entry->pCallCmd->batchStub == NULL)) {
+      rec->stub = skipStub;
+    }
+  }
+  rec[1].stub = NULL;
+  rec[1].cmd = NULL;
+  rec[1].cmdId = 0;
+  rec[1].entryIdx = DISPATCH_UNBOUND;
+  rec[1].batchLen = 0;
+
+  uint32_t *slot = recordSlot(context, cmd, 1);
+  if (slot == NULL) {
+    pl2b_errPrintf(error, PL2B_ERR_MALLOC, cmd->sourceInfo, NULL,
+                   "run: cannot allocate memory for bindings");
+    return 0;
+  }
+  *slot = ++context->codeSize;
+  return 1;
+}
+
+static pl2b_Cmd *skipStub(pl2b_Program *program,
+                          void *context,
+                          pl2b_Cmd *cmd,
+                          pl2b_Error *error) {
+  (void)program;
+  (void)context;
+  (void)error;
+  return cmd->next;
+}
+
+/* marks runs among records emitted since `start`, back to front */
+static void markBatchRuns(RunContext *context, uint32_t start) {
+  for (uint32_t i = context->codeSize; i-- > start;) {
+    ThreadedRecord *rec = &context->code[i];
+    if (rec->entryIdx < DISPATCH_FIRST) {
+      continue;
+    }
+    const pl2b_PCallCmd *pCallCmd =
+      context->dispatch->entries[rec->entryIdx].pCallCmd;
+    /* blocks may rather run in parallel */
+    if (pCallCmd->batchStub == NULL
+        || (rec->cmd->group != 0 && pCallCmd->threadSafe)) {
+      continue;
+    }
+
+    const ThreadedRecord *follow = rec + 1;
+    if (i + 1 < context->codeSize
+        && follow->entryIdx == rec->entryIdx
+        && follow->cmd == rec->cmd->next
+        && isSameCmd(follow->cmd, rec->cmd)) {
+      rec->batchLen = follow->batchLen + 1;
+      rec->stub = NULL;
+    }
+  }
+}
+
+/* marks heads of blocks among records emitted since `start` */
+static void markParallelBlocks(RunContext *context, uint32_t start) {
+  uint32_t i = start;
+  while (i < context->codeSize) {
+    ThreadedRecord *head = &context->code[i];
+    uint32_t count = blockLength(head);
+    _Bool parallel = head->cmd->group != 0 && count >= 2;
+    for (uint32_t j = 0; parallel && j < count; j++) {
+      const ThreadedRecord *rec = &head[j];
+      parallel = rec->entryIdx >= DISPATCH_FIRST
+                 && context->dispatch->entries[rec->entryIdx]
+                      .pCallCmd->threadSafe
+                 && rec->stub != NULL
+                 && rec->stub != skipStub;
+    }
+    if (parallel) {
+      head->stub = NULL;
+      head->batchLen = 0;
+    }
+    i += count;
+  }
+}
+
+/* counts records following `head` in program order within its group */
+static uint32_t blockLength(const ThreadedRecord *head) {
+  uint32_t count = 1;
+  while (head[count].cmd != NULL
+         && head[count].cmd == head[count - 1].cmd->next
+         && head[count].cmd->id == head[count].cmdId
+         && head[count].cmd->group == head->cmd->group) {
+    count++;
+  }
+  return count;
+}
+
+typedef struct st_block_task {
+  RunContext *context;
+  pl2b_PCallCmdStub *stub;
+  pl2b_Cmd *cmd;
+  pl2b_Cmd *next;
+  pl2b_Error *error;
+  uint64_t ticks;          /* time taken, if profiling */
+} BlockTask;
+
+static void runBlockTask(void *arg, uint32_t idx) {
+  BlockTask *task = &((BlockTask*)arg)[idx];
+  RunContext *context = task->context;
+  RunContext *outer = activeRun;
+  activeRun = context;
+  uint64_t start = context->profile != NULL ? profileClock() : 0;
+  const char *name = task->cmd->cmd.str;
+  uint32_t line = task->cmd->sourceInfo.line;
+  PROBE2(cmd_entry, name, line);
+  task->next = task->stub(context->program, context->userContext,
+                          task->cmd, task->error);
+  PROBE2(cmd_return, name, line);
+  if (context->profile != NULL) {
+    task->ticks = profileClock() - start;
+  }
+  activeRun = outer;
+}
+
+/* Runs `count` records from `head` at once and returns where to go on */
+static pl2b_Cmd *runBlock(RunContext *context,
+                          ThreadedRecord *head,
+                          uint32_t count,
+                          pl2b_Error *error) {
+  if (context->program->lazy != NULL) {
+    lazyParseNext(context->program, head[count - 1].cmd);
+  }
+
+  BlockTask *tasks = (BlockTask*)calloc(count, sizeof(BlockTask));
+  _Bool ok = tasks != NULL;
+  for (uint32_t i = 0; ok && i < count; i++) {
+    BlockTask *task = &tasks[i];
+    task->context = context;
+    task->stub = i == 0
+                 ? context->dispatch->entries[head->entryIdx].stub
+                 : head[i].stub;
+    task->cmd = head[i].cmd;
+    task->error = pl2b_errorBuffer(error->errorBufferSize);
+    /* slots cannot be created while tasks run */
+    ok = task->error != NULL && extraSlot(context, task->cmd, 1) != NULL;
+  }
+
+  pl2b_Cmd *ret = NULL;
+  if (!ok) {
+    pl2b_errPrintf(error, PL2B_ERR_MALLOC, head->cmd->sourceInfo, NULL,
+                   "run: cannot allocate memory for parallel block");
+  } else {
+    context->inParallel = 1;
+    poolRun(runBlockTask, tasks, count);
+    context->inParallel = 0;
+
+    for (uint32_t i = 0; context->profile != NULL && i < count; i++) {
+      addProfileTicks(&context->profSlots[head - context->code + i],
+                      tasks[i].ticks);
+    }
+
+    ret = head[count - 1].cmd->next;
+    for (uint32_t i = 0; i < count; i++) {
+      pl2b_Error *taskError = tasks[i].error;
+      if (pl2b_isError(taskError)) {
+        pl2b_errPrintf(error, taskError->errorCode, taskError->sourceInfo,
+                       taskError->extraData, "%s", taskError->reason);
+        ret = NULL;
+        break;
+      }
+    }
+    for (uint32_t i = 0; ret != NULL && i < count; i++) {
+      if (tasks[i].next != tasks[i].cmd->next) {
+        ret = tasks[i].next;
+        break;
+      }
+    }
+  }
+
+  for (uint32_t i = 0; tasks != NULL && i < count; i++) {
+    if (tasks[i].error != NULL) {
+      pl2b_dropError(tasks[i].error);
+    }
+  }
+  free(tasks);
+  return ret;
+}
+
+static _Bool isSameCmd(const pl2b_Cmd *cmd1, const pl2b_Cmd *cmd2) {
+  if (cmd1->cmd.symbol != PL2B_SYM_NONE
+      && cmd2->cmd.symbol != PL2B_SYM_NONE) {
+    return cmd1->cmd.symbol == cmd2->cmd.symbol;
+  }
+  return cmd1->cmd.len == cmd2->cmd.len
+         && !memcmp(cmd1->cmd.str, cmd2->cmd.str, cmd1->cmd.len);
+}
+
+static _Bool loadLanguage(RunContext *context,
+                          pl2b_Cmd *cmd,
+                          pl2b_Error *error) {
+  if (context->language != NULL) {
+    pl2b_errPrintf(error, PL2B_ERR_LOAD_LANG, cmd->sourceInfo, NULL,
+                   "language: another language already loaded");
+    return 0;
+  }
+
+  uint32_t argsLen = pl2b_argsLen(cmd);
+  if (argsLen != 2) {
+    pl2b_errPrintf(error, PL2B_ERR_LOAD_LANG, cmd->sourceInfo, NULL,
+                   "language: expected 2 arguments, got %u",
+                   argsLen - 1);
+    return 0;
+  }
+
+  if (context->module != NULL) {
+    /* left by a previous `language` with NULL descriptor */
+    releaseModule(context->module);
+  }
+  context->module = acquireModule(cmd->args[0].str, cmd->args[1].str,
+                                  cmd->sourceInfo, error);
+  if (context->module == NULL) {
+    return 0;
+  }
+  context->language = context->module->language;
+  context->dispatch = context->module->dispatch;
+
+  if (context->language != NULL && context->language->init != NULL) {
+    context->userContext = context->language->init(error);
+    if (pl2b_isError(error)) {
+      error->sourceInfo = cmd->sourceInfo;
+      return 0;
+    }
+  }
+
+  if (context->dispatch != NULL && !linkProgram(context, error)) {
+    return 0;
+  }
+  return 1;
+}
+
+static uint32_t resolveEntry(RunContext *context, const pl2b_Cmd *cmd) {
+  uint32_t idx = resolveBuiltin(cmd);
+  if (idx == DISPATCH_FALLBACK) {
+    if (context->dispatch == NULL) {
+      return DISPATCH_UNBOUND;
+    }
+    idx = resolveDispatch(context->dispatch, cmd);
+  }
+  return idx;
+}
+
+/* Returns the entry index `cmd` binds to, and emits its record unless
+   `cmd` is unknown or removed. */
+static uint32_t bindCmd(RunContext *context,
+                        pl2b_Cmd *cmd,
+                        pl2b_Error *error) {
+  uint32_t idx = resolveEntry(context, cmd);
+  if (idx == DISPATCH_UNBOUND
+      || (idx >= DISPATCH_FIRST
+          && context->dispatch->entries[idx].pCallCmd->removed)) {
+    return idx;
+  }
+
+  emitRecord(context, cmd, idx, error);
+  return idx;
+}
+
+/*** ---------------------------- Link ----------------------------- ***/
+
+/* The link pass binds every parsed command once the language is
+   loaded. Unknown and removed commands are reported together in one
+   error, deprecated and stubless ones in one warning per kind. Commands
+   are grouped by name in reports, listing at most LINK_REPORT_LINES
+   line numbers per name. Routers only see command names, so interned
+   commands get resolved once per symbol. */
+
+#define LINK_REPORT_LINES 8
+#define LINK_UNRESOLVED   0xfffffffeu
+
+typedef struct st_cmd_list {
+  pl2b_Cmd **cmds;
+  size_t count;
+  size_t cap;
+} CmdList;
+
+static _Bool cmdListPush(CmdList *list, pl2b_Cmd *cmd);
+static void printCmdGroups(FILE *fp, CmdList *list);
+static int cmpCmdByName(const void *lhs, const void *rhs);
+
+static _Bool linkProgram(RunContext *context, pl2b_Error *error) {
+  CmdList unknown = { NULL, 0, 0 };
+  CmdList removed = { NULL, 0, 0 };
+  CmdList deprecated = { NULL, 0, 0 };
+  CmdList stubless = { NULL, 0, 0 };
+  pl2b_Cmd *firstBad = NULL;
+  _Bool ok = 1;
+
+  const SymbolTable *symbols = (const SymbolTable*)context->program->symbols;
+  uint32_t symbolCount = symbols != NULL ? symbols->entryCount + 1 : 0;
+  uint32_t *bySymbol = NULL;
+  if (symbolCount != 0) {
+    bySymbol = (uint32_t*)malloc(symbolCount * sizeof(uint32_t));
+    ok = bySymbol != NULL;
+    for (uint32_t i = 0; ok && i < symbolCount; i++) {
+      bySymbol[i] = LINK_UNRESOLVED;
+    }
+  }
+
+  uint32_t codeStart = context->codeSize;
+  for (pl2b_Cmd *cmd = context->program->commands;
+       cmd != NULL && !isLazyError(context->program, cmd) && ok;
+       cmd = cmd->next) {
+    uint32_t idx;
+    if (cmd->cmd.symbol != PL2B_SYM_NONE && cmd->cmd.symbol < symbolCount) {
+      idx = bySymbol[cmd->cmd.symbol];
+      if (idx == LINK_UNRESOLVED) {
+        idx = resolveEntry(context, cmd);
+        bySymbol[cmd->cmd.symbol] = idx;
+      }
+    } else {
+      idx = resolveEntry(context, cmd);
+    }
+
+    if (idx == DISPATCH_UNBOUND) {
+      firstBad = firstBad == NULL ? cmd : firstBad;
+      ok = cmdListPush(&unknown, cmd);
+      continue;
+    }
+    if (idx < DISPATCH_FIRST) {
+      if (!emitRecord(context, cmd, idx, error)) {
+        ok = 0;
+        break;
+      }
+      continue;
+    }
+
+    const pl2b_PCallCmd *pCallCmd = context->dispatch->entries[idx].pCallCmd;
+    if (pCallCmd->removed) {
+      firstBad = firstBad == NULL ? cmd : firstBad;
+      ok = cmdListPush(&removed, cmd);
+      continue;
+    }
+    if (!emitRecord(context, cmd, idx, error)) {
+      ok = 0;
+      break;
+    }
+    if (pCallCmd->deprecated) {
+      ok = cmdListPush(&deprecated, cmd);
+    }
+    if (ok && pCallCmd->stub == NULL && pCallCmd->batchStub == NULL) {
+      ok = cmdListPush(&stubless, cmd);
+    }
+  }
+
+  if (!ok) {
+    if (!pl2b_isError(error)) {
+      pl2b_errPrintf(error, PL2B_ERR_MALLOC, pl2b_sourceInfo(NULL, 0),
+                     NULL, "link: cannot allocate memory for link report");
+    }
+  } else {
+    if (deprecated.count != 0) {
+      fprintf(stderr, "[int/w] using deprecated commands: ");
+      printCmdGroups(stderr, &deprecated);
+      fputc('\n', stderr);
+    }
+    if (stubless.count != 0) {
+      fprintf(stderr, "[int/w] entries exist but NULL for commands: ");
+      printCmdGroups(stderr, &stubless);
+      fputc('\n', stderr);
+    }
+  }
+
+  if (ok && firstBad == NULL) {
+    markBatchRuns(context, codeStart);
+    markParallelBlocks(context, codeStart);
+    keyProfileSlots(context);
+  }
+
+  if (ok && firstBad != NULL) {
+    char *report = NULL;
+    size_t reportSize = 0;
+    FILE *fp = open_memstream(&report, &reportSize);
+    if (fp != NULL) {
+      if (unknown.count != 0) {
+        fprintf(fp, "unknown commands: ");
+        printCmdGroups(fp, &unknown);
+      }
+      if (removed.count != 0) {
+        fprintf(fp, "%sremoved commands: ", unknown.count != 0 ? "; " : "");
+        printCmdGroups(fp, &removed);
+      }
+      fclose(fp);
+    }
+    pl2b_errPrintf(error,
+                   unknown.count != 0
+                     ? PL2B_ERR_UNKNOWN_CMD
+                     : PL2B_ERR_REMOVED_CMD,
+                   firstBad->sourceInfo, NULL,
+                   "%s", report != NULL ? report : "link failed");
+    free(report);
+    ok = 0;
+  }
+
+  free(bySymbol);
+  free(unknown.cmds);
+  free(removed.cmds);
+  free(deprecated.cmds);
+  free(stubless.cmds);
+  return ok;
+}
+
+static _Bool cmdListPush(CmdList *list, pl2b_Cmd *cmd) {
+  if (list->count == list->cap) {
+    size_t newCap = list->cap == 0 ? 16 : list->cap * 2;
+    pl2b_Cmd **newCmds = (pl2b_Cmd**)realloc(
+      list->cmds, newCap * sizeof(pl2b_Cmd*)
+    );
+    if (newCmds == NULL) {
+      return 0;
+    }
+    list->cmds = newCmds;
+    list->cap = newCap;
+  }
+  list->cmds[list->count++] = cmd;
+  return 1;
+}
+
+/* prints "`a` (lines 1, 5), `b` (line 3)", sorting `list` by name */
+static void printCmdGroups(FILE *fp, CmdList *list) {
+  qsort(list->cmds, list->count, sizeof(pl2b_Cmd*), cmpCmdByName);
+  size_t start = 0;
+  while (start < list->count) {
+    const pl2b_CmdPart *name = &list->cmds[start]->cmd;
+    size_t end = start + 1;
+    while (end < list->count
+           && list->cmds[end]->cmd.len == name->len
+           && !memcmp(list->cmds[end]->cmd.str, name->str, name->len)) {
+      end++;
+    }
+
+    fprintf(fp, "%s`%s` (line%s ", start != 0 ? ", " : "", name->str,
+            end - start > 1 ? "s" : "");
+    for (size_t i = start; i < end && i < start + LINK_REPORT_LINES; i++) {
+      fprintf(fp, "%s%u", i != start ? ", " : "",
+              list->cmds[i]->sourceInfo.line);
+    }
+    if (end - start > LINK_REPORT_LINES) {
+      fprintf(fp, " and %zu more", end - start - LINK_REPORT_LINES);
+    }
+    fputc(')', fp);
+    start = end;
+  }
+}
+
+static int cmpCmdByName(const void *lhs, const void *rhs) {
+  const pl2b_Cmd *cmd1 = *(pl2b_Cmd *const*)lhs;
+  const pl2b_Cmd *cmd2 = *(pl2b_Cmd *const*)rhs;
+  if (cmd1->cmd.len != cmd2->cmd.len) {
+    return cmd1->cmd.len < cmd2->cmd.len ? -1 : 1;
+  }
+  int cmp = memcmp(cmd1->cmd.str, cmd2->cmd.str, cmd1->cmd.len);
+  if (cmp != 0) {
+    return cmp;
+  }
+  if (cmd1->sourceInfo.line != cmd2->sourceInfo.line) {
+    return cmd1->sourceInfo.line < cmd2->sourceInfo.line ? -1 : 1;
+  }
+  return 0;
+}
+
+/*** -------------------------- Scheduler -------------------------- ***/
+
+/* Ready runs are taken in FIFO order. Runs waiting on fds register a
+   `dup` of the fd to epoll one-shot, since epoll takes every fd only
+   once and several runs may wait on the same one. The duplicate is
+   closed once woken. Runs waiting on timers sit in a
+   binary heap ordered by deadline, the earliest of which bounds the
+   epoll timeout; a single clock serves any number of sleeping runs.
+   Busy runs yield after SCHED_SLICE_STEPS commands, and go to the back
+   of the ready queue. */
+
+#define SCHED_EVENTS      64
+#define SCHED_MIN_TIMERS  16
+#define SCHED_SLICE_STEPS 4096
+
+struct st_pl2b_scheduler {
+  int epollFd;
+  RunContext *readyHead;
+  RunContext *readyTail;
+  RunContext **timers;
+  size_t timerCount;
+  size_t timerCap;
+  size_t fdWaitCount;
+  RunContext *live;   /* all runs not finished yet */
+};
+
+static void schedReady(pl2b_Scheduler *scheduler, RunContext *context);
+static void schedStep(pl2b_Scheduler *scheduler, RunContext *context);
+static _Bool schedWait(pl2b_Scheduler *scheduler, RunContext *context);
+static void schedFinish(pl2b_Scheduler *scheduler, RunContext *context);
+static _Bool timerPush(pl2b_Scheduler *scheduler, RunContext *context);
+static RunContext *timerPop(pl2b_Scheduler *scheduler);
+
+pl2b_Scheduler *pl2b_createScheduler(pl2b_Error *error) {
+  pl2b_Scheduler *ret = (pl2b_Scheduler*)malloc(sizeof(pl2b_Scheduler));
+  if (ret == NULL) {
+    pl2b_errPrintf(error, PL2B_ERR_MALLOC, pl2b_sourceInfo(NULL, 0),
+                   NULL, "scheduler: cannot allocate memory");
+    return NULL;
+  }
+
+  ret->epollFd = epoll_create1(EPOLL_CLOEXEC);
+  if (ret->epollFd < 0) {
+    pl2b_errPrintf(error, PL2B_ERR_GENERAL, pl2b_sourceInfo(NULL, 0),
+                   NULL, "scheduler: cannot create epoll instance: %s",
+                   strerror(errno));
+    free(ret);
+    return NULL;
+  }
+  ret->readyHead = NULL;
+  ret->readyTail = NULL;
+  ret->timers = NULL;
+  ret->timerCount = 0;
+  ret->timerCap = 0;
+  ret->fdWaitCount = 0;
+  ret->live = NULL;
+  return ret;
+}
+
+_Bool pl2b_schedule(pl2b_Scheduler *scheduler,
+                    pl2b_Program *program,
+                    pl2b_Error *error,
+                    pl2b_RunDone *done,
+                    void *arg) {
+  RunContext *context = createRunContext(program);
+  if (context == NULL) {
+    pl2b_errPrintf(error, PL2B_ERR_MALLOC, pl2b_sourceInfo(NULL, 0),
+                   NULL, "run: cannot allocate memory for run context");
+    return 0;
+  }
+
+  context->scheduler = scheduler;
+  context->error = error;
+  context->done = done;
+  context->doneArg = arg;
+  context->nextLive = scheduler->live;
+  if (scheduler->live != NULL) {
+    scheduler->live->prevLive = context;
+  }
+  scheduler->live = context;
+  schedReady(scheduler, context);
+  return 1;
+}
+
+void pl2b_runScheduler(pl2b_Scheduler *scheduler, pl2b_Error *error) {
+  struct epoll_event events[SCHED_EVENTS];
+  while (1) {
+    while (scheduler->readyHead != NULL) {
+      RunContext *context = scheduler->readyHead;
+      scheduler->readyHead = context->nextReady;
+      if (scheduler->readyHead == NULL) {
+        scheduler->readyTail = NULL;
+      }
+      context->nextReady = NULL;
+      schedStep(scheduler, context);
+    }
+    if (scheduler->timerCount == 0 && scheduler->fdWaitCount == 0) {
+      return;
+    }
+
+    int timeout = -1;
+    if (scheduler->timerCount != 0) {
+      uint64_t now = monotonicNanos();
+      uint64_t deadline = scheduler->timers[0]->deadline;
+      timeout = deadline <= now
+                ? 0
+                : (int)((deadline - now + 999999) / 1000000);
+    }
+
+    int count = epoll_wait(scheduler->epollFd, events, SCHED_EVENTS,
+                           timeout);
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      pl2b_errPrintf(error, PL2B_ERR_GENERAL, pl2b_sourceInfo(NULL, 0),
+                     NULL, "scheduler: epoll_wait failed: %s",
+                     strerror(errno));
+      return;
+    }
+    for (int i = 0; i < count; i++) {
+      RunContext *context = (RunContext*)events[i].data.ptr;
+      epoll_ctl(scheduler->epollFd, EPOLL_CTL_DEL, context->waitDup, NULL);
+      close(context->waitDup);
+      context->waitDup = -1;
+      scheduler->fdWaitCount--;
+      schedReady(scheduler, context);
+    }
+
+    uint64_t now = monotonicNanos();
+    while (scheduler->timerCount != 0
+           && scheduler->timers[0]->deadline <= now) {
+      schedReady(scheduler, timerPop(scheduler));
+    }
+  }
+}
+
+void pl2b_dropScheduler(pl2b_Scheduler *scheduler) {
+  while (scheduler->live != NULL) {
+    RunContext *context = scheduler->live;
+    scheduler->live = context->nextLive;
+    if (context->waitDup >= 0) {
+      close(context->waitDup);
+    }
+    destroyRunContext(context);
+  }
+  close(scheduler->epollFd);
+  free(scheduler->timers);
+  free(scheduler);
+}
+
+static void schedReady(pl2b_Scheduler *scheduler, RunContext *context) {
+  context->waitKind = RUN_WAIT_NONE;
+  if (scheduler->readyTail != NULL) {
+    scheduler->readyTail->nextReady = context;
+  } else {
+    scheduler->readyHead = context;
+  }
+  scheduler->readyTail = context;
+}
+
+static void schedStep(pl2b_Scheduler *scheduler, RunContext *context) {
+  context->stepLimit = SCHED_SLICE_STEPS;
+  RunState state = runThreaded(context, context->error);
+  if (state == RUN_YIELDED) {
+    schedReady(scheduler, context);
+    return;
+  }
+  if (state == RUN_SUSPENDED && schedWait(scheduler, context)) {
+    return;
+  }
+  schedFinish(scheduler, context);
+}
+
+static _Bool schedWait(pl2b_Scheduler *scheduler, RunContext *context) {
+  if (context->waitKind == RUN_WAIT_TIMER) {
+    if (!timerPush(scheduler, context)) {
+      pl2b_errPrintf(context->error, PL2B_ERR_MALLOC,
+                     pl2b_sourceInfo(NULL, 0), NULL,
+                     "scheduler: cannot allocate memory for timer");
+      return 0;
+    }
+    return 1;
+  }
+
+  struct epoll_event event;
+  event.events = EPOLLONESHOT
+                 | ((context->waitEvents & PL2B_WAIT_READ) ? EPOLLIN : 0)
+                 | ((context->waitEvents & PL2B_WAIT_WRITE) ? EPOLLOUT : 0);
+  event.data.ptr = context;
+  context->waitDup = fcntl(context->waitFd, F_DUPFD_CLOEXEC, 0);
+  if (context->waitDup >= 0
+      && epoll_ctl(scheduler->epollFd, EPOLL_CTL_ADD, context->waitDup,
+                   &event) == 0) {
+    scheduler->fdWaitCount++;
+    return 1;
+  }
+  int savedErrno = errno;
+  if (context->waitDup >= 0) {
+    close(context->waitDup);
+    context->waitDup = -1;
+  }
+  if (savedErrno == EPERM) {
+    /* regular files and such are always ready */
+    schedReady(scheduler, context);
+    return 1;
+  }
+
+  pl2b_errPrintf(context->error, PL2B_ERR_GENERAL,
+                 context->waitCmd != NULL
+                 ? context->waitCmd->sourceInfo
+                 : pl2b_sourceInfo(NULL, 0),
+                 NULL, "scheduler: cannot wait on fd %d: %s",
+                 context->waitFd, strerror(savedErrno));
+  return 0;
+}
+
+static void schedFinish(pl2b_Scheduler *scheduler, RunContext *context) {
+  if (context->prevLive != NULL) {
+    context->prevLive->nextLive = context->nextLive;
+  } else {
+    scheduler->live = context->nextLive;
+  }
+  if (context->nextLive != NULL) {
+    context->nextLive->prevLive = context->prevLive;
+  }
+
+  pl2b_Program *program = context->program;
+  pl2b_Error *error = context->error;
+  pl2b_RunDone *done = context->done;
+  void *doneArg = context->doneArg;
+  dumpTraceOnError(context, error);
+  destroyRunContext(context);
+  if (done != NULL) {
+    done(program, error, doneArg);
+  }
+}
+
+static _Bool timerPush(pl2b_Scheduler *scheduler, RunContext *context) {
+  if (scheduler->timerCount == scheduler->timerCap) {
+    size_t newCap = scheduler->timerCap != 0
+                    ? scheduler->timerCap * 2
+                    : SCHED_MIN_TIMERS;
+    RunContext **newTimers = (RunContext**)realloc(
+      scheduler->timers, newCap * sizeof(RunContext*)
+    );
+    if (newTimers == NULL) {
+      return 0;
+    }
+    scheduler->timers = newTimers;
+    scheduler->timerCap = newCap;
+  }
+
+  RunContext **heap = scheduler->timers;
+  size_t idx = scheduler->timerCount++;
+  while (idx != 0 && heap[(idx - 1) / 2]->deadline > context->deadline) {
+    heap[idx] = heap[(idx - 1) / 2];
+    idx = (idx - 1) / 2;
+  }
+  heap[idx] = context;
+  return 1;
+}
+
+static RunContext *timerPop(pl2b_Scheduler *scheduler) {
+  RunContext **heap = scheduler->timers;
+  RunContext *ret = heap[0];
+  RunContext *last = heap[--scheduler->timerCount];
+  size_t count = scheduler->timerCount;
+  size_t idx = 0;
+  while (idx * 2 + 1 < count) {
+    size_t child = idx * 2 + 1;
+    if (child + 1 < count
+        && heap[child + 1]->deadline < heap[child]->deadline) {
+      child++;
+    }
+    if (heap[child]->deadline >= last->deadline) {
+      break;
+    }
+    heap[idx] = heap[child];
+    idx = child;
+  }
+  heap[idx] = last;
+  return ret;
 }
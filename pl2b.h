@@ -11,7 +11,7 @@
 #define PL2_EDITION_JP    "ピリ-2B"  /* Japanese name */
 #define PL2_EDITION_KR    "펠리-2B"  /* Kroean name */
 #define PL2B_VER_MAJOR    0          /* Major version of PL2B */
-#define PL2B_VER_MINOR    2          /* Minor version of PL2B */
+#define PL2B_VER_MINOR    3          /* Minor version of PL2B */
 #define PL2B_VER_PATCH    0          /* Patch version of PL2B */
 #define PL2B_VER_POSTFIX  "Oort"     /* Version postfix */
 
@@ -39,10 +39,10 @@ typedef enum e_pl2b_cmp_result {
 
 typedef struct st_pl2b_source_info {
   const char *fileName;
-  uint16_t line;
+  uint32_t line;
 } pl2b_SourceInfo;
 
-pl2b_SourceInfo pl2b_sourceInfo(const char *fileName, uint16_t line);
+pl2b_SourceInfo pl2b_sourceInfo(const char *fileName, uint32_t line);
 
 /*** -------------------------- pl2b_Error ------------------------- ***/
 
@@ -67,6 +67,8 @@ typedef enum e_pl2b_error_code {
   PL2B_ERR_NO_LANG        = 9,  /* language not loaded */
   PL2B_ERR_UNKNOWN_CMD    = 10, /* unknown command */
   PL2B_ERR_MALLOC         = 11, /* malloc failure*/
+  PL2B_ERR_REMOVED_CMD    = 12, /* removed command */
+  PL2B_ERR_PARALLEL       = 13, /* misplaced or unclosed ?parallel */
 
   PL2B_ERR_USER           = 100 /* generic user error */
 } pl2b_ErrorCode;
@@ -86,12 +88,25 @@ _Bool pl2b_isError(pl2b_Error *error);
 
 /*** --------------------------- pl2b_Cmd -------------------------- ***/
 
+#define PL2B_PART_MAX_LEN 0x7fffffffu /* largest `len` of a part */
+
+/* `str` is always NUL-terminated, while `len` also counts any NUL
+   bytes produced by `\0` escapes within string literals */
 typedef struct st_pl2b_cmd_part {
   char *str;
-  _Bool isString;
+  uint32_t len : 31;
+  uint32_t isString : 1;
+  uint32_t symbol;    /* interned id of `str`, or PL2B_SYM_NONE */
 } pl2b_CmdPart;
 
+/* pl2b_cmdPart and pl2b_cmdPart3 clamp `len` to PL2B_PART_MAX_LEN, while
+   pl2b_cmdPart4 reports longer parts as error and returns an empty part */
 pl2b_CmdPart pl2b_cmdPart(char *str, _Bool isString);
+pl2b_CmdPart pl2b_cmdPart3(char *str, size_t len, _Bool isString);
+pl2b_CmdPart pl2b_cmdPart4(char *str,
+                           size_t len,
+                           _Bool isString,
+                           pl2b_Error *error);
 
 #define PL2B_EMPTY_PART(cmdPart) (!((cmdPart).str))
 
@@ -99,11 +114,15 @@ typedef struct st_pl2b_cmd {
   struct st_pl2b_cmd *prev;
   struct st_pl2b_cmd *next;
 
-  void *extraData;
-  void *resolveCache;
+  void *extraData;     /* left to the builder of the command, runs keep
+                          theirs in pl2b_cmdExtraSlot */
   pl2b_SourceInfo sourceInfo;
+  uint32_t argc;      /* count of `args`, excluding terminating part */
+  uint32_t group;     /* line of enclosing `?parallel`, or 0 */
+  uint64_t id;        /* set by the parser and pl2b_cmd3/pl2b_cmd6, and
+                         unlike addresses never reused in a process */
   pl2b_CmdPart cmd;
-  pl2b_CmdPart args[0];
+  pl2b_CmdPart *args; /* `argc` parts followed by an empty part */
 } pl2b_Cmd;
 
 pl2b_Cmd *pl2b_cmd3(pl2b_SourceInfo sourceInfo,
@@ -117,21 +136,132 @@ pl2b_Cmd *pl2b_cmd6(pl2b_Cmd *prev,
                     pl2b_CmdPart cmd,
                     pl2b_CmdPart args[]);
 
-uint16_t pl2b_argsLen(pl2b_Cmd *cmd);
+uint32_t pl2b_argsLen(pl2b_Cmd *cmd);
 
 /*** ------------------------- pl2b_Program ------------------------ ***/
 
 typedef struct st_pl2b_program {
   pl2b_Cmd *commands;
+  void *arena;     /* owns all commands if not NULL */
+  void *symbols;   /* owns interned strings if not NULL */
+  size_t cmdCount; /* commands form a dense array if not 0 */
+  void *lazy;      /* parser state while not completely parsed */
 } pl2b_Program;
 
+typedef enum e_pl2b_parse_flags {
+  PL2B_PARSE_ARENA  = 1, /* place commands in arena, see pl2b_parseArena */
+  PL2B_PARSE_INTERN = 2, /* intern parts into the program symbol table */
+  PL2B_PARSE_DENSE  = 4, /* lay commands out as an array, implies ARENA */
+  PL2B_PARSE_LAZY   = 8  /* parse commands as they are reached, implies
+                            ARENA and overrides DENSE */
+} pl2b_ParseFlags;
+
+typedef enum e_pl2b_symbol {
+  PL2B_SYM_NONE     = 0, /* not interned */
+  PL2B_SYM_LANGUAGE = 1, /* `language` */
+  PL2B_SYM_ABORT    = 2  /* `abort` */
+} pl2b_Symbol;
+
 void pl2b_initProgram(pl2b_Program *program);
+/* `parseBufferSize` is an initial capacity hint for the number of parts
+   in one command. Commands of any length are accepted. */
 pl2b_Program pl2b_parse(char *source,
                         uint16_t parseBufferSize,
                         pl2b_Error *error);
+/* Same as pl2b_parse, but places all commands in a few large blocks
+   owned by the program, so that pl2b_dropProgram frees them at once.
+   Commands created with pl2b_cmd3/pl2b_cmd6 and linked into such a
+   program still get freed one by one, as in any other program. */
+pl2b_Program pl2b_parseArena(char *source,
+                             uint16_t parseBufferSize,
+                             pl2b_Error *error);
+/* Parses with a combination of pl2b_ParseFlags. With PL2B_PARSE_INTERN,
+   all parts are copied into a deduplicated string pool owned by the
+   program, and each distinct string gets a symbol id that is stable
+   for the life of the program. Source may then be released right after
+   parsing, but interned strings are shared and must not be modified.
+   With PL2B_PARSE_DENSE, commands are fixed-size records in one array
+   and their arguments are in one separate pool, so that running the
+   program walks memory sequentially. `prev` and `next` still link the
+   records, so language stubs work the same; links stay pointers rather
+   than indices because stubs return the command to run next, and in
+   the array `next` is just the following record. `make layout-bench`
+   compares the layouts in ns/command.
+   With PL2B_PARSE_LAZY, only the first command is parsed up front, and
+   source must stay alive until the program is dropped. pl2b_run parses
+   the successor of each command before executing it, so `cmd->next` is
+   always valid inside a stub. A command failing to parse is replaced by
+   an empty placeholder, whose syntax error is reported once execution
+   reaches it, so stubs returning NULL before it still end the run
+   cleanly. Stubs walking further shall use pl2b_nextCmd, which returns
+   NULL and reports the error at the placeholder. */
+pl2b_Program pl2b_parse4(char *source,
+                         uint16_t parseBufferSize,
+                         uint16_t flags,
+                         pl2b_Error *error);
+/* Parses on up to `threadCount` threads (0 for one per CPU) into an
+   arena-backed program. Source is left untouched, and is not referred
+   to by the program. Chunks given to threads are at least 64 KiB, or
+   as many bytes as the environment variable PL2B_PARSE_CHUNK_MIN says;
+   `make parallel-test` lowers it to compare against pl2b_parse. */
+pl2b_Program pl2b_parseParallel(const char *source,
+                                uint16_t parseBufferSize,
+                                uint16_t threadCount,
+                                pl2b_Error *error);
 void pl2b_dropProgram(pl2b_Program *program);
 void pl2b_debugPrintProgram(const pl2b_Program *program);
 
+/* Symbol id of `str` in an interned program, or PL2B_SYM_NONE */
+uint32_t pl2b_lookupSymbol(const pl2b_Program *program, const char *str);
+const char *pl2b_symbolName(const pl2b_Program *program, uint32_t symbol);
+
+/* `cmd->next`, parsing it first if the program is lazy */
+pl2b_Cmd *pl2b_nextCmd(pl2b_Program *program,
+                       pl2b_Cmd *cmd,
+                       pl2b_Error *error);
+
+#define PL2B_NO_INDEX ((size_t)-1)
+
+/* Index of `cmd` in a dense program, or PL2B_NO_INDEX */
+size_t pl2b_cmdIndex(const pl2b_Program *program, const pl2b_Cmd *cmd);
+
+/*** ----------------------- pl2b_ParseStream ---------------------- ***/
+
+typedef struct st_pl2b_parse_stream pl2b_ParseStream;
+
+/* Receives every command as soon as it is complete. The command is one
+   heap block together with its strings, has no prev/next links, and is
+   owned by receiver, which may link it into a program or free it. */
+typedef void (pl2b_StreamCmdStub)(void *userData, pl2b_Cmd *cmd);
+
+pl2b_ParseStream *pl2b_createParseStream(uint16_t parseBufferSize,
+                                         pl2b_StreamCmdStub *onCmd,
+                                         void *userData);
+void pl2b_feedParseStream(pl2b_ParseStream *stream,
+                          const char *chunk,
+                          size_t chunkSize,
+                          pl2b_Error *error);
+void pl2b_finishParseStream(pl2b_ParseStream *stream, pl2b_Error *error);
+void pl2b_dropParseStream(pl2b_ParseStream *stream);
+
+/*** ------------------------ Program images ----------------------- ***/
+
+/* Hash of source text, identifying images built from it */
+uint64_t pl2b_sourceHash(const char *source, size_t size);
+
+/* Serializes a parsed program into an image file at `path`. Lazy
+   programs are refused, as only part of them may be parsed. */
+void pl2b_saveProgramImage(const pl2b_Program *program,
+                           uint64_t sourceHash,
+                           const char *path,
+                           pl2b_Error *error);
+
+/* Maps an image saved from the same source by the same PL2B version.
+   Returns 0 if the image is missing, stale or malformed. */
+_Bool pl2b_loadProgramImage(const char *path,
+                            uint64_t sourceHash,
+                            pl2b_Program *program);
+
 /*** -------------------- Semantic-ver parsing  -------------------- ***/
 
 #define PL2B_SEMVER_POSTFIX_LEN 15
@@ -145,6 +275,13 @@ typedef struct st_pl2b_sem_ver {
 } pl2b_SemVer;
 
 pl2b_SemVer pl2b_zeroVersion(void);
+pl2b_SemVer pl2b_semVer4(uint16_t major,
+                         uint16_t minor,
+                         uint16_t patch,
+                         const char *postfix);
+/* Version of the PL2B library actually loaded, to be checked against
+   PL2B_HEADER_VERSION the caller was compiled with */
+pl2b_SemVer pl2b_version(void);
 pl2b_SemVer pl2b_parseSemVer(const char *src, pl2b_Error *error);
 _Bool pl2b_isZeroVersion(pl2b_SemVer ver);
 _Bool pl2b_isAlpha(pl2b_SemVer ver);
@@ -153,12 +290,24 @@ _Bool pl2b_isCompatible(pl2b_SemVer expected, pl2b_SemVer actual);
 pl2b_CmpResult pl2b_semverCmp(pl2b_SemVer ver1, pl2b_SemVer ver2);
 void pl2b_semverToString(pl2b_SemVer ver, char *buffer);
 
+#define PL2B_HEADER_VERSION \
+  pl2b_semVer4(PL2B_VER_MAJOR, PL2B_VER_MINOR, PL2B_VER_PATCH, \
+               PL2B_VER_POSTFIX)
+
 /*** ------------------------ pl2b_Extension ----------------------- ***/
 
 typedef pl2b_Cmd *(pl2b_PCallCmdStub)(pl2b_Program *program,
                                       void *context,
                                       pl2b_Cmd *command,
                                       pl2b_Error *error);
+/* Runs `count` consecutive commands of the same name, starting from
+   `first` and following `next`. Returns the command to continue with,
+   which is usually the `next` of the last command in the batch. */
+typedef pl2b_Cmd *(pl2b_PCallBatchStub)(pl2b_Program *program,
+                                        void *context,
+                                        pl2b_Cmd *first,
+                                        uint32_t count,
+                                        pl2b_Error *error);
 typedef _Bool (pl2b_CmdRouterStub)(pl2b_CmdPart cmd);
 
 typedef void *(pl2b_InitStub)(pl2b_Error *error);
@@ -171,6 +320,14 @@ typedef struct st_pl2b_pcall_func {
   pl2b_PCallCmdStub *stub;
   _Bool deprecated;
   _Bool removed;
+  /* optional, used instead of `stub` for runs of two or more commands,
+     and for single commands as well if there is no `stub` */
+  pl2b_PCallBatchStub *batchStub;
+  /* `stub` may run concurrently with other thread-safe commands on the
+     same context, as done for `?parallel` blocks made of such commands
+     only. Waits then block, and pl2b_cmdExtraSlot only finds slots of
+     commands in the block. */
+  _Bool threadSafe;
 } pl2b_PCallCmd;
 
 #define PL2B_EMPTY_SINVOKE_CMD(cmd) \
@@ -192,10 +349,133 @@ typedef struct st_pl2b_langauge {
 typedef pl2b_Language *(pl2b_LoadLanguage)(pl2b_SemVer version,
                                            pl2b_Error *error);
 
+/* Slot of data a language keeps for `cmd` during the current run of
+   `program`, starting as NULL, and given to `cmdCleanup` once the run
+   ends unless still NULL. Runs do not write to programs, so one program
+   may be run by several threads at once, unless parsed lazily. NULL if
+   not called from a stub running `program`, or if out of memory. */
+void **pl2b_cmdExtraSlot(pl2b_Program *program, pl2b_Cmd *cmd);
+
+typedef enum e_pl2b_wait_events {
+  PL2B_WAIT_READ  = 1,
+  PL2B_WAIT_WRITE = 2
+} pl2b_WaitEvents;
+
+/* Stubs return these to wait until `fd` is ready for `events`, or until
+   `nanos` passed, and then continue from `resume`. Runs on a scheduler
+   get suspended meanwhile, letting other runs go on; otherwise, these
+   block and return `resume` right away. */
+pl2b_Cmd *pl2b_waitFd(pl2b_Program *program,
+                      int fd,
+                      uint32_t events,
+                      pl2b_Cmd *resume);
+pl2b_Cmd *pl2b_waitTimer(pl2b_Program *program,
+                         uint64_t nanos,
+                         pl2b_Cmd *resume);
+
 /*** ----------------------------- Run ----------------------------- ***/
 
 void pl2b_run(pl2b_Program *program, pl2b_Error *error);
 
+/* State of a run going on in steps, between pl2b_runStart and
+   pl2b_runFinish */
+typedef struct st_pl2b_run_context pl2b_RunContext;
+
+typedef enum e_pl2b_run_status {
+  PL2B_RUN_FINISHED = 0, /* program ended, aborted or failed */
+  PL2B_RUN_YIELDED  = 1  /* budget used up, call pl2b_runSteps again */
+} pl2b_RunStatus;
+
+pl2b_RunContext *pl2b_runStart(pl2b_Program *program,
+                               pl2b_Error *error);
+/* Runs at most `maxSteps` commands, a run of batched commands counting
+   each, and yields once `nanos` passed, as checked between commands
+   every now and then. Either being 0 means no limit. A `?parallel`
+   block runs as a whole even if exceeding the budget. Waits through
+   pl2b_waitFd or pl2b_waitTimer block. */
+pl2b_RunStatus pl2b_runSteps(pl2b_RunContext *context,
+                             uint64_t maxSteps,
+                             uint64_t nanos,
+                             pl2b_Error *error);
+/* Ends the run, whether finished or not */
+void pl2b_runFinish(pl2b_RunContext *context);
+
+/* Language libraries stay loaded after runs, to be reused by later
+   runs. Unloads those of `langId`, or all with NULL, once no running
+   program uses them. Returns the number of modules evicted. */
+size_t pl2b_evictLanguages(const char *langId);
+
+/*** -------------------------- Profiling -------------------------- ***/
+
+/* Timings of commands in runs a profile is attached to, summed up per
+   command name and source line: calls, plus total, min and max time in
+   stubs, and time spent dispatching to them. A batch stub's time is
+   split evenly over its commands. Dispatch is timed on one call in 64
+   only, and its mean is taken off the stub times of all calls. One
+   profile may be shared by runs on several threads, and gets their
+   timings once they end. */
+typedef struct st_pl2b_profile pl2b_Profile;
+
+pl2b_Profile *pl2b_createProfile(void);
+void pl2b_dropProfile(pl2b_Profile *profile);
+
+/* Like pl2b_run, recording into `profile` */
+void pl2b_runProfiled(pl2b_Program *program,
+                      pl2b_Profile *profile,
+                      pl2b_Error *error);
+/* Attaches `profile` to a run started by pl2b_runStart */
+void pl2b_runProfile(pl2b_RunContext *context, pl2b_Profile *profile);
+
+/* Writes a table per command name and one per source line, sorted by
+   total stub time */
+void pl2b_writeProfileReport(pl2b_Profile *profile,
+                             const char *path,
+                             pl2b_Error *error);
+/* Writes folded stacks, as read by flamegraph tools, in nanoseconds */
+void pl2b_writeProfileFolded(pl2b_Profile *profile,
+                             const char *path,
+                             pl2b_Error *error);
+
+/*** --------------------------- Tracing --------------------------- ***/
+
+/* Runs started after setting a trace size keep their last `size`
+   commands, rounded up to a power of two, with line, stub and time.
+   0, the default, turns tracing off. A trace gets dumped to stderr when
+   a run fails, and on demand for all traced runs going on. */
+void pl2b_setTraceSize(uint32_t size);
+
+/* Dumps traces of up to 64 runs going on to stderr when `signo` gets
+   delivered. Returns 0 if the handler cannot be installed. */
+_Bool pl2b_traceOnSignal(int signo);
+
+/* Writes the trace of a run started by pl2b_runStart to `fd` */
+void pl2b_dumpTrace(pl2b_RunContext *context, int fd);
+
+/*** -------------------------- Scheduler -------------------------- ***/
+
+/* Runs many programs on the calling thread, switching between them
+   whenever one waits through pl2b_waitFd or pl2b_waitTimer. */
+typedef struct st_pl2b_scheduler pl2b_Scheduler;
+
+/* Called once a scheduled program finishes, `error` telling how */
+typedef void (pl2b_RunDone)(pl2b_Program *program,
+                            pl2b_Error *error,
+                            void *arg);
+
+pl2b_Scheduler *pl2b_createScheduler(pl2b_Error *error);
+/* Queues `program`, which must not be run elsewhere meanwhile. `error`
+   must stay alive until `done`, which may be NULL, gets called. */
+_Bool pl2b_schedule(pl2b_Scheduler *scheduler,
+                    pl2b_Program *program,
+                    pl2b_Error *error,
+                    pl2b_RunDone *done,
+                    void *arg);
+/* Returns once all scheduled programs finished, or on failure of the
+   scheduler itself reported in `error` */
+void pl2b_runScheduler(pl2b_Scheduler *scheduler, pl2b_Error *error);
+/* Drops programs still running without calling their `done` */
+void pl2b_dropScheduler(pl2b_Scheduler *scheduler);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
@@ -83,17 +83,17 @@ const char *pl2ext_startsWith(const char *src, const char *prefix) {
 
 /*** ----------------------- Arguments Helper ---------------------- ***/
 
-uint16_t pl2ext_argLen(const char **args) {
+uint32_t pl2ext_argLen(const char **args) {
   assert(args != NULL);
-  uint16_t acc = 0;
+  uint32_t acc = 0;
   for (; *args != NULL; acc++, args++);
   return acc;
 }
 
 _Bool pl2ext_checkArgsLen(const char **args,
-                          uint16_t minArgLen,
-                          uint16_t maxArgLen) {
-  uint16_t len = pl2ext_argLen(args);
+                          uint32_t minArgLen,
+                          uint32_t maxArgLen) {
+  uint32_t len = pl2ext_argLen(args);
   return len >= minArgLen && len <= maxArgLen;
 }
 
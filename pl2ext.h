@@ -20,10 +20,10 @@ const char *pl2ext_startsWith(const char *src, const char *prefix);
 
 /*** ---------------------- Arguments helper ----------------------- ***/
 
-uint16_t pl2ext_argLen(const char **args);
+uint32_t pl2ext_argLen(const char **args);
 _Bool pl2ext_checkArgsLen(const char **args,
-                          uint16_t minArgLen,
-                          uint16_t maxArgLen);
+                          uint32_t minArgLen,
+                          uint32_t maxArgLen);
 
 /*** ----------------------------- NaCl ---------------------------- ***/
 